@@ -0,0 +1,3717 @@
+/* artistic.c */
+#include <float.h>
+#include <math.h>
+#include <stdarg.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+#ifdef WIN32
+#include <malloc.h>
+#endif
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <sys/mman.h>
+#include <sys/resource.h>
+#define HAVE_POSIX 1
+#endif
+
+#include "artistic.h"
+
+// Measures the time and cache misses of a piece of code.
+typedef struct {
+	struct timespec start;
+	// Perf event counting cache misses, or -1 if unavailable.
+	int fd;
+} Probe;
+
+// A sector of the image that is a node of its quadtree.
+typedef struct {
+	// The path from the root to this node, two bits per level,
+	// which is also its morton code among the nodes of its level.
+	uint64_t code;
+	uint32_t x, y;
+	uint32_t width, height;
+	uint8_t level;
+	// Whether the sector is all edges (1) or all not edges (0).
+	uint8_t value;
+} QuadNode;
+
+// A connected region of pixels that are not edges, while it is measured.
+typedef struct {
+	uint64_t sum_x, sum_y, size;
+	// Where its seed goes and how far that is from its centroid.
+	Point seed;
+	double distance;
+} Component;
+
+// Mean color and position of the pixels of a SLIC superpixel.
+typedef struct {
+	float r, g, b, x, y;
+} SlicCenter;
+
+// Running totals of the pixels of a SLIC superpixel.
+typedef struct {
+	uint64_t r, g, b, x, y, count;
+} SlicSum;
+
+// A SLIC superpixel along with how many pixels it has.
+typedef struct {
+	uint64_t size;
+	uint32_t cell;
+} SlicRank;
+
+// A node along with how far it is from being uniform.
+typedef struct {
+	QuadNode node;
+	double score;
+} RankedNode;
+
+// Decides which sectors of the image are uniform enough to be leaves.
+typedef struct {
+	SplitMode mode;
+	size_t width, height;
+	// Summed-area table of the edges when splitting on them,
+	// or of the color channels when splitting on variance.
+	void* table;
+	size_t table_size;
+	// Largest color variance a leaf can have.
+	double tolerance;
+} SplitTest;
+
+// The leaves of a quadtree stored in morton order.
+typedef struct {
+	Memory* mem;
+	uint32_t width, height;
+	QuadNode* leaves;
+	size_t count;
+	size_t capacity;
+} QuadTree;
+
+static const Rgb BLACK = (Rgb) {0, 0, 0};
+static const Rgb WHITE = (Rgb) {255, 255, 255};
+
+static const char* stage_names[] = { "blur", "edges", "seeds", "stylize" };
+
+// Names of the seeders, in the order of Seeder.
+static const char* seeder_names[] = {
+	"quadtree", "poisson", "importance", "components", "slic"
+};
+
+// Names of the allocators, in the order of AllocatorKind.
+static const char* allocator_names[] = { "malloc", "pool", "mmap" };
+
+// Names of the morphological operations, in the order of Morphology.
+static const char* morph_names[] = {
+	"none", "dilate", "erode", "open", "close"
+};
+
+// How many pixels around the center each edge operator reads and
+// how strongly it responds to a unit step, in the order of EdgeOperator.
+static const struct {
+	const char* name;
+	int radius;
+	int gain;
+} edge_operators[] = {
+	{ "sobel",    1, 4 },
+	{ "sobel5x5", 2, 48 },
+	{ "scharr",   1, 16 },
+	{ "prewitt",  1, 3 },
+};
+
+void mem_set_stage(Memory* mem, Stage stage);
+void mem_end_stage(Memory* mem);
+static long page_faults();
+static inline void lock(atomic_flag* flag);
+static inline void unlock(atomic_flag* flag);
+
+static void* system_alloc(void* ctx, size_t size);
+static void system_release(void* ctx, void* ptr, size_t size);
+
+void pool_init(Pool* pool);
+void pool_drain(Pool* pool);
+static size_t pool_class(size_t size);
+static size_t pool_class_size(size_t c);
+static void* pool_alloc(void* ctx, size_t size);
+static void pool_release(void* ctx, void* ptr, size_t size);
+static void* mmap_alloc(void* ctx, size_t size);
+static void mmap_release(void* ctx, void* ptr, size_t size);
+
+int blur(Memory* mem, ImageView in, ImageView out, int radius);
+static void box_blur_rows(ImageView in, ImageView out, size_t radius);
+static void box_blur_cols(ImageView in, ImageView out, size_t radius);
+
+void stylize(
+	ImageView out, const Point* seeds, const Rgb* colors, size_t seed_count
+);
+static inline int point_before(Point a, Point b);
+
+void pick_colors(
+	ImageView in, const Point* seeds, Rgb* colors, size_t seed_count
+);
+
+int sort_seeds(Memory* mem, Point* seeds, Rgb* colors, size_t count);
+static inline uint64_t morton_code(uint32_t x, uint32_t y);
+
+void probe_start(Probe* probe);
+void probe_stop(Probe* probe, FILE* log, const char* label);
+
+static void report(
+	const ArtisticContext* ctx, const char* format, ...
+);
+static void free_edges(ArtisticRun* run);
+static ArtisticStatus fail_step(Memory* mem, ArtisticRun* run);
+
+int find_seeds(const QuadTree* tree, SeedList* seeds);
+
+int build_quadtree(Memory* mem, QuadTree* tree, const SplitTest* test);
+
+int build_quadtree_budget(
+	Memory* mem, QuadTree* tree, const SplitTest* test, size_t budget
+);
+
+int init_edge_split(Memory* mem, SplitTest* test, ImageView edges);
+int init_variance_split(
+	Memory* mem, SplitTest* test, ImageView in, double tolerance
+);
+
+void free_split(Memory* mem, SplitTest* test);
+static double node_score(const SplitTest* test, const QuadNode* node);
+static int node_is_uniform(
+	const SplitTest* test, const QuadNode* node, double score
+);
+static uint8_t node_value(const SplitTest* test, const QuadNode* node);
+
+static int split_node(const QuadNode* node, QuadNode children[4]);
+static RankedNode rank_node(const SplitTest* test, QuadNode node);
+static inline int ranks_before(const RankedNode* a, const RankedNode* b);
+static int compare_ranks(const void* a, const void* b);
+static int compare_codes(const void* a, const void* b);
+static void heap_push(RankedNode* heap, size_t* count, RankedNode node);
+static RankedNode heap_pop(RankedNode* heap, size_t* count);
+
+void free_quadtree(QuadTree* tree);
+int save_quadtree(const QuadTree* tree, const char* path);
+ArtisticStatus load_quadtree(Memory* mem, QuadTree* tree, const char* path);
+static int quadtree_push(QuadTree* tree, QuadNode leaf);
+static int valid_leaf(const QuadTree* tree, const QuadNode* leaf);
+static int is_sector(const QuadTree* tree, const QuadNode* leaf);
+static inline uint64_t node_key(const QuadNode* node);
+static int compare_nodes(const void* a, const void* b);
+
+int place_poisson_seeds(
+	Memory* mem, SeedList* seeds, ImageView edges,
+	float min_radius, float max_radius
+);
+
+static float poisson_radius(
+	const uint32_t* table, size_t width, size_t height,
+	Point p, float min_radius, float max_radius
+);
+
+int place_importance_seeds(
+	Memory* mem, SeedList* seeds,
+	size_t width, size_t height, const uint32_t* magnitudes,
+	size_t count
+);
+
+static int build_alias_table(
+	Memory* mem, float* weights, uint32_t* alias, size_t count
+);
+
+static inline uint64_t next_random(uint64_t* state);
+static inline float random_unit(uint64_t* state);
+
+int place_component_seeds(Memory* mem, SeedList* seeds, ImageView edges);
+
+int place_slic_seeds(
+	Memory* mem, SeedList* seeds, ImageView in,
+	size_t count, float compactness
+);
+static int compare_slic_sizes(const void* a, const void* b);
+static int compare_slic_cells(const void* a, const void* b);
+
+/**
+ * Find the root of the given pixel, halving its path on the way.
+ */
+static inline uint32_t find_component(uint32_t* parents, uint32_t i) {
+	while (parents[i] != i) {
+		parents[i] = parents[parents[i]];
+		i = parents[i];
+	}
+
+	return i;
+}
+
+/**
+ * Join the regions of two pixels, keeping the first pixel
+ * of both as their root.
+ */
+static inline void join_components(uint32_t* parents, uint32_t a, uint32_t b) {
+	a = find_component(parents, a);
+	b = find_component(parents, b);
+
+	if (a < b) {
+		parents[b] = a;
+	} else {
+		parents[a] = b;
+	}
+}
+
+void seed_list_init(SeedList* list, Memory* mem);
+void seed_list_free(SeedList* list);
+int seed_list_reserve(SeedList* list, size_t capacity);
+static int seed_list_push(SeedList* list, Point seed);
+
+uint32_t* build_edge_table(Memory* mem, ImageView edges);
+uint64_t* build_color_table(Memory* mem, ImageView in);
+
+/**
+ * Add up the color channels and their squares inside the given area
+ * with four lookups into its summed-area table.
+ */
+static inline void sum_colors(
+	const uint64_t* table, size_t width,
+	size_t start_x, size_t start_y,
+	size_t end_x, size_t end_y,
+	uint64_t sums[6]
+) {
+	const size_t stride = 6 * (width + 1);
+	const uint64_t* a = table + start_y*stride + 6*start_x;
+	const uint64_t* b = table + start_y*stride + 6*end_x;
+	const uint64_t* c = table + end_y*stride + 6*start_x;
+	const uint64_t* d = table + end_y*stride + 6*end_x;
+
+	for (int i = 0; i < 6; i++) {
+		sums[i] = d[i] - b[i] - c[i] + a[i];
+	}
+}
+
+/**
+ * Count the edges inside the given area
+ * with four lookups into its summed-area table.
+ */
+static inline uint32_t count_edges(
+	const uint32_t* table, size_t width,
+	size_t start_x, size_t start_y,
+	size_t end_x, size_t end_y
+) {
+	const size_t stride = width + 1;
+	return table[end_y*stride + end_x]
+		- table[start_y*stride + end_x]
+		- table[end_y*stride + start_x]
+		+ table[start_y*stride + start_x];
+}
+
+int detect_edges(
+	Memory* mem, ImageView in, ImageView out,
+	uint32_t* magnitudes, int threshold, EdgeOperator op
+);
+
+int detect_edges_pyramid(
+	Memory* mem, ImageView in, ImageView out,
+	uint32_t* magnitudes, int threshold, EdgeOperator op, int levels
+);
+
+static int64_t edge_limit(int threshold, EdgeOperator op);
+void downsample(ImageView in, ImageView out);
+
+int morph_edges(Memory* mem, ImageView edges, Morphology op, int radius);
+static void morph_pass(
+	size_t width, size_t height, uint64_t* bits, uint64_t* scratch,
+	size_t radius, int erode
+);
+static void morph_row(size_t width, uint64_t* row, size_t radius, int erode);
+static void morph_shift(
+	uint64_t* row, size_t words, size_t distance, int back,
+	uint64_t fill, int erode
+);
+
+// Deepest level a quadtree can reach, so that its codes fit in 64 bits.
+static const int quadtree_max_depth = 31;
+// Marks files written by save_quadtree().
+static const uint32_t quadtree_magic = 0x31545141;
+
+// Share of the importance sampling probability spread evenly over the image.
+static const float importance_floor = 0.1;
+// Rows of the strips that connected regions are first found in.
+static const size_t component_strip = 64;
+// Width of the frame around the image that edge detection leaves black,
+// which would otherwise join every region touching the border.
+static const size_t component_frame = 2;
+// Label of the pixels that are not part of any region.
+static const uint32_t no_component = UINT32_MAX;
+
+// Rounds of assigning pixels to SLIC centers and moving the centers.
+static const int slic_iterations = 10;
+
+// Pixels per seed for seeders that need a count when none was given.
+static const size_t default_seed_ratio = 64;
+
+// Alignment of the memory handed out to the stages and of image rows.
+static const size_t image_align = 64;
+// Sizes of the pages mmap_alloc() faults in and aligns blocks to.
+static const size_t small_page = 4096;
+static const size_t huge_page = 2 << 20;
+
+// Number of box blur passes used to approximate a gaussian blur.
+static const int blur_passes = 3;
+
+// Largest blur radius accepted, which keeps the window sums of the box blur
+// well inside 32 bits.
+static const int max_blur_radius = 1 << 16;
+// Largest morphology radius accepted. Past the sizes of the image,
+// a larger one changes nothing.
+static const int max_morph_radius = 1 << 16;
+// Largest edge detection threshold accepted, well past the strongest
+// gradient of any operator.
+static const int max_threshold = 1 << 16;
+// Seeds are numbered with 32 bits while they are sorted.
+static const size_t max_seed_budget = UINT32_MAX;
+
+/**
+ * Fill the given parameters with the defaults of the command line.
+ */
+void artistic_default_params(ArtisticParams* params) {
+	params->threshold = 0;
+	params->blur_radius = 0;
+	params->op = OPERATOR_SOBEL;
+	params->pyramid_levels = 1;
+	params->morph = MORPH_NONE;
+	params->morph_radius = 1;
+	params->tree_in = NULL;
+	params->tree_out = NULL;
+	params->sort_seeds = 1;
+	params->profile = 0;
+	params->seed_budget = 0;
+	params->seeder = SEEDER_QUADTREE;
+	params->split = SPLIT_EDGES;
+	params->tolerance = 300;
+	params->min_radius = 2;
+	params->max_radius = 16;
+	params->compactness = 20;
+}
+
+/**
+ * Check that the given parameters are in range.
+ *
+ * Returns 0 if any of them is not.
+ */
+int artistic_check_params(const ArtisticParams* params) {
+	return params->threshold >= 0 && params->threshold <= max_threshold
+		&& params->blur_radius >= 0
+		&& params->blur_radius <= max_blur_radius
+		&& params->op >= 0 && params->op < OPERATOR_COUNT
+		&& params->pyramid_levels >= 1 && params->pyramid_levels <= 8
+		&& params->morph >= 0 && params->morph < MORPH_COUNT
+		&& params->morph_radius >= 1
+		&& params->morph_radius <= max_morph_radius
+		&& params->seed_budget <= max_seed_budget
+		&& params->seeder >= 0 && params->seeder < SEEDER_COUNT
+		// Only some seeders can be asked for an exact number of seeds.
+		&& (params->seed_budget == 0 || (params->seeder != SEEDER_POISSON
+			&& params->seeder != SEEDER_COMPONENTS))
+		&& params->split >= 0 && params->split < SPLIT_COUNT
+		&& params->tolerance >= 0
+		&& params->compactness >= 0
+		&& params->min_radius >= 1
+		&& params->max_radius >= params->min_radius;
+}
+
+/**
+ * Set up a context whose stages get their memory from the given allocator.
+ *
+ * The context holds its own pool, so it must not be moved once set up.
+ */
+void artistic_init(ArtisticContext* ctx, AllocatorKind allocator) {
+	memset(ctx, 0, sizeof(*ctx));
+	atomic_flag_clear(&ctx->mem.lock);
+	ctx->mem.allocator = (Allocator) { system_alloc, system_release, NULL };
+
+	if (allocator == ALLOC_POOL) {
+		pool_init(&ctx->pool);
+		ctx->mem.allocator = (Allocator) {
+			pool_alloc, pool_release, &ctx->pool
+		};
+	} else if (allocator == ALLOC_MMAP) {
+		ctx->mem.allocator = (Allocator) { mmap_alloc, mmap_release, NULL };
+	}
+}
+
+/**
+ * Give back the memory kept by the given context.
+ */
+void artistic_free(ArtisticContext* ctx) {
+	if (ctx->mem.allocator.ctx == &ctx->pool) {
+		pool_drain(&ctx->pool);
+	}
+}
+
+/**
+ * Stylize the input image into the output image, which the caller owns
+ * and must have the same sizes.
+ *
+ * Only touches the given context, so runs on different contexts
+ * can go on at the same time.
+ */
+ArtisticStatus artistic_run(
+	ArtisticContext* ctx, const ArtisticParams* params,
+	ImageView in, ImageView out
+) {
+	if (out.width != in.width || out.height != in.height) {
+		return ARTISTIC_SIZE_MISMATCH;
+	}
+
+	ArtisticRun run;
+	artistic_begin(&run, in);
+	ArtisticStatus status = artistic_detect_edges(ctx, params, &run);
+
+	if (status == ARTISTIC_OK) {
+		status = artistic_place_seeds(ctx, params, &run);
+	}
+
+	if (status == ARTISTIC_OK) {
+		status = artistic_stylize(ctx, params, &run, out);
+	}
+
+	ctx->seed_count = run.seed_count;
+	artistic_end(&run);
+	return status;
+}
+
+/**
+ * Start a run of the pipeline on the given image,
+ * whose steps are then taken one at a time.
+ */
+void artistic_begin(ArtisticRun* run, ImageView in) {
+	memset(run, 0, sizeof(*run));
+	run->in = in;
+	run->smooth = in;
+}
+
+/**
+ * First step of a run: blur the image and find its edges,
+ * unless the seeder doesn't need them or the quadtree comes from a file.
+ *
+ * Like the other steps, ends the run if it runs out of memory.
+ */
+ArtisticStatus artistic_detect_edges(
+	ArtisticContext* ctx, const ArtisticParams* params, ArtisticRun* run
+) {
+	Memory* mem = &ctx->mem;
+	const size_t width = run->in.width;
+	const size_t height = run->in.height;
+
+	if (params->tree_in) {
+		return ARTISTIC_OK;
+	}
+
+	run->edges_mem = mem;
+
+	// Smooth out noise that would otherwise show up as speckle edges.
+	mem_set_stage(mem, STAGE_BLUR);
+
+	if (params->blur_radius > 0) {
+		run->smooth = alloc_view(mem, width, height);
+
+		if (!run->smooth.data
+				|| !blur(mem, run->in, run->smooth, params->blur_radius)) {
+			return fail_step(mem, run);
+		}
+
+		report(ctx, "Blur        : radius %d\n", params->blur_radius);
+	}
+
+	// SLIC and splitting the quadtree on color variance
+	// don't look at edges.
+	const int use_edges = params->seeder != SEEDER_SLIC
+		&& (params->seeder != SEEDER_QUADTREE
+			|| params->split == SPLIT_EDGES);
+
+	if (use_edges) {
+		mem_set_stage(mem, STAGE_EDGES);
+		run->edges = alloc_view(mem, width, height);
+
+		if (!run->edges.data) {
+			return fail_step(mem, run);
+		}
+
+		// Only the importance seeder needs the gradient magnitudes.
+		if (params->seeder == SEEDER_IMPORTANCE) {
+			run->magnitudes = mem_alloc(
+				mem, sizeof(uint32_t) * width * height
+			);
+
+			if (!run->magnitudes) {
+				return fail_step(mem, run);
+			}
+		}
+
+		int found;
+
+		if (params->pyramid_levels > 1) {
+			found = detect_edges_pyramid(
+				mem, run->smooth, run->edges, run->magnitudes,
+				params->threshold, params->op, params->pyramid_levels
+			);
+		} else {
+			found = detect_edges(
+				mem, run->smooth, run->edges, run->magnitudes,
+				params->threshold, params->op
+			);
+		}
+
+		if (!found) {
+			return fail_step(mem, run);
+		}
+
+		if (params->pyramid_levels > 1) {
+			report(ctx, "Pyramid     : %d levels\n",
+				params->pyramid_levels);
+		}
+
+		if (params->morph != MORPH_NONE) {
+			if (!morph_edges(
+					mem, run->edges, params->morph, params->morph_radius)) {
+				return fail_step(mem, run);
+			}
+
+			report(ctx, "Morphology  : %s radius %d\n",
+				morph_names[params->morph], params->morph_radius);
+		}
+	}
+
+	mem_end_stage(mem);
+	return ARTISTIC_OK;
+}
+
+/**
+ * Second step of a run: place the seeds, then give back the buffers
+ * of the first step.
+ */
+ArtisticStatus artistic_place_seeds(
+	ArtisticContext* ctx, const ArtisticParams* params, ArtisticRun* run
+) {
+	Memory* mem = &ctx->mem;
+	const size_t width = run->in.width;
+	const size_t height = run->in.height;
+	const size_t count = params->seed_budget > 0 ? params->seed_budget
+		: width * height / default_seed_ratio;
+	QuadTree tree;
+
+	mem_set_stage(mem, STAGE_SEEDS);
+	seed_list_init(&run->seeds, mem);
+
+	if (params->tree_in) {
+		ArtisticStatus status = load_quadtree(mem, &tree, params->tree_in);
+
+		if (status == ARTISTIC_OUT_OF_MEMORY) {
+			return fail_step(mem, run);
+		}
+
+		if (status != ARTISTIC_OK) {
+			mem_end_stage(mem);
+			return status;
+		}
+
+		if (tree.width != width || tree.height != height) {
+			free_quadtree(&tree);
+			mem_end_stage(mem);
+			return ARTISTIC_TREE_UNREADABLE;
+		}
+	} else {
+		SplitTest split;
+		int placed;
+
+		switch (params->seeder) {
+		case SEEDER_POISSON:
+			placed = place_poisson_seeds(
+				mem, &run->seeds, run->edges,
+				params->min_radius, params->max_radius
+			);
+			break;
+		case SEEDER_COMPONENTS:
+			placed = place_component_seeds(mem, &run->seeds, run->edges);
+			break;
+		case SEEDER_IMPORTANCE:
+			placed = place_importance_seeds(
+				mem, &run->seeds, width, height, run->magnitudes, count
+			);
+			break;
+		case SEEDER_SLIC:
+			placed = place_slic_seeds(
+				mem, &run->seeds, run->smooth, count, params->compactness
+			);
+			break;
+		default:
+			if (params->split == SPLIT_EDGES) {
+				placed = init_edge_split(mem, &split, run->edges);
+			} else {
+				placed = init_variance_split(
+					mem, &split, run->smooth, params->tolerance
+				);
+				report(ctx, "Variance    : tolerance %g\n",
+					params->tolerance);
+			}
+
+			if (placed && params->seed_budget > 0) {
+				placed = build_quadtree_budget(
+					mem, &tree, &split, params->seed_budget
+				);
+			} else if (placed) {
+				placed = build_quadtree(mem, &tree, &split);
+			}
+
+			free_split(mem, &split);
+			break;
+		}
+
+		free_edges(run);
+
+		if (!placed) {
+			return fail_step(mem, run);
+		}
+	}
+
+	if (params->seeder == SEEDER_QUADTREE || params->tree_in) {
+		if (params->tree_out && !save_quadtree(&tree, params->tree_out)) {
+			free_quadtree(&tree);
+			mem_end_stage(mem);
+			return ARTISTIC_TREE_UNWRITABLE;
+		}
+
+		int found = find_seeds(&tree, &run->seeds);
+		free_quadtree(&tree);
+
+		if (!found) {
+			return fail_step(mem, run);
+		}
+	}
+
+	run->seed_count = run->seeds.count;
+	report(ctx, "Seeds found : %zu\n", run->seed_count);
+	mem_end_stage(mem);
+	return ARTISTIC_OK;
+}
+
+/**
+ * Last step of a run: paint the cell of every seed into the output image,
+ * which must have the same sizes as the input, then give back the seeds.
+ */
+ArtisticStatus artistic_stylize(
+	ArtisticContext* ctx, const ArtisticParams* params, ArtisticRun* run,
+	ImageView out
+) {
+	Memory* mem = &ctx->mem;
+	SeedList* seeds = &run->seeds;
+
+	if (out.width != run->in.width || out.height != run->in.height) {
+		return ARTISTIC_SIZE_MISMATCH;
+	}
+
+	mem_set_stage(mem, STAGE_STYLIZE);
+
+	// Some seeders find nothing on tiny or featureless images,
+	// in which case the whole image becomes the cell of a single seed.
+	if (seeds->count == 0) {
+		Point center = { run->in.width / 2, run->in.height / 2 };
+
+		if (!seed_list_push(seeds, center)) {
+			return fail_step(mem, run);
+		}
+	}
+
+	Rgb* colors = mem_alloc(mem, sizeof(Rgb) * seeds->count);
+
+	if (!colors) {
+		return fail_step(mem, run);
+	}
+
+	pick_colors(run->in, seeds->data, colors, seeds->count);
+
+	if (params->sort_seeds
+			&& !sort_seeds(mem, seeds->data, colors, seeds->count)) {
+		mem_free(mem, colors, sizeof(Rgb) * seeds->count);
+		return fail_step(mem, run);
+	}
+
+	if (params->profile) {
+		Probe probe;
+		probe_start(&probe);
+		stylize(out, seeds->data, colors, seeds->count);
+		probe_stop(&probe, ctx->log, "Stylize");
+	} else {
+		stylize(out, seeds->data, colors, seeds->count);
+	}
+
+	mem_free(mem, colors, sizeof(Rgb) * seeds->count);
+	seed_list_free(seeds);
+	mem_end_stage(mem);
+	return ARTISTIC_OK;
+}
+
+/**
+ * Give back whatever buffers the steps of a run still hold,
+ * which is nothing once it has been stylized.
+ */
+void artistic_end(ArtisticRun* run) {
+	free_edges(run);
+
+	if (run->seeds.mem) {
+		seed_list_free(&run->seeds);
+	}
+}
+
+/**
+ * Give back the buffers of the first step of a run
+ * to the memory they came from.
+ */
+static void free_edges(ArtisticRun* run) {
+	Memory* mem = run->edges_mem;
+
+	if (!mem) {
+		return;
+	}
+
+	if (run->edges.data) {
+		free_view(mem, run->edges);
+	}
+
+	if (run->smooth.data != run->in.data) {
+		free_view(mem, run->smooth);
+	}
+
+	mem_free(
+		mem, run->magnitudes,
+		sizeof(uint32_t) * run->in.width * run->in.height
+	);
+	run->edges = (ImageView) { NULL };
+	run->smooth = run->in;
+	run->magnitudes = NULL;
+	run->edges_mem = NULL;
+}
+
+/**
+ * End a run whose step ran out of memory, giving back the buffers
+ * the run holds. The step has given back its own ones by then.
+ */
+static ArtisticStatus fail_step(Memory* mem, ArtisticRun* run) {
+	artistic_end(run);
+	mem_end_stage(mem);
+	return ARTISTIC_OUT_OF_MEMORY;
+}
+
+/**
+ * Print a line of progress to the log of the given context, if it has one.
+ */
+static void report(const ArtisticContext* ctx, const char* format, ...) {
+	if (!ctx->log) {
+		return;
+	}
+
+	va_list args;
+	va_start(args, format);
+	vfprintf(ctx->log, format, args);
+	va_end(args);
+}
+
+/**
+ * Find the seeder with the given name.
+ *
+ * Returns -1 if there is none.
+ */
+int find_seeder(const char* name) {
+	for (int i = 0; i < SEEDER_COUNT; i++) {
+		if (strcmp(seeder_names[i], name) == 0) {
+			return i;
+		}
+	}
+
+	return -1;
+}
+
+/**
+ * Find the allocator with the given name.
+ *
+ * Returns -1 if there is none.
+ */
+int find_allocator(const char* name) {
+	for (int i = 0; i < ALLOC_COUNT; i++) {
+		if (strcmp(allocator_names[i], name) == 0) {
+			return i;
+		}
+	}
+
+	return -1;
+}
+
+/**
+ * Stylize the given image based on its seeds into a voronoi diagram
+ * using the euclidean distance as a metric. A pixel as close to several
+ * seeds takes the color of the topmost, then leftmost one of them,
+ * so that the order of the seeds doesn't change the result.
+ *
+ * Performs badly because every pixel calculates its distance to every seed.
+ */
+void stylize(
+	ImageView out, const Point* seeds, const Rgb* colors, size_t seed_count
+) {
+	for (size_t row = 0; row < out.height; row++) {
+		Rgb* line = view_row(out, row);
+
+		for (size_t col = 0; col < out.width; col++) {
+			size_t closest_seed = 0;
+			int closest_dist = INT32_MAX;
+
+			for (size_t i = 0; i < seed_count; i++) {
+				Point seed = seeds[i];
+
+				int dx = (int) col - (int) seed.x;
+				int dy = (int) row - (int) seed.y;
+				int dist = dx*dx + dy*dy;
+
+				if (dist < closest_dist || (dist == closest_dist
+						&& point_before(seed, seeds[closest_seed]))) {
+					closest_seed = i;
+					closest_dist = dist;
+				}
+			}
+
+			line[col] = colors[closest_seed];
+		}
+	}
+}
+
+/**
+ * Whether the first point is above the second one,
+ * or left of it on the same row.
+ */
+static inline int point_before(Point a, Point b) {
+	return a.y < b.y || (a.y == b.y && a.x < b.x);
+}
+
+/**
+ * Look up the color of the pixel under every seed,
+ * which is the color of its whole cell once stylized.
+ */
+void pick_colors(
+	ImageView in, const Point* seeds, Rgb* colors, size_t seed_count
+) {
+	for (size_t i = 0; i < seed_count; i++) {
+		colors[i] = view_row(in, seeds[i].y)[seeds[i].x];
+	}
+}
+
+/**
+ * Sort the given seeds and their colors along a z-order curve,
+ * so that seeds close to each other on the image
+ * are also close to each other in memory.
+ *
+ * This is a least significant digit radix sort of their morton codes,
+ * skipping the digits that are zero for every seed.
+ *
+ * See also: https://en.wikipedia.org/wiki/Z-order_curve
+ *
+ * Returns 0 if it runs out of memory, leaving the seeds as they were.
+ */
+int sort_seeds(Memory* mem, Point* seeds, Rgb* colors, size_t count) {
+	enum { digit_bits = 8, buckets = 1 << digit_bits };
+
+	if (count < 2) {
+		return 1;
+	}
+
+	const size_t keys_size = sizeof(uint64_t) * count;
+	const size_t order_size = sizeof(uint32_t) * count;
+	uint64_t* keys = mem_alloc(mem, keys_size);
+	uint64_t* sorted_keys = mem_alloc(mem, keys_size);
+	uint32_t* order = mem_alloc(mem, order_size);
+	uint32_t* sorted_order = mem_alloc(mem, order_size);
+	uint64_t all_bits = 0;
+
+	if (!keys || !sorted_keys || !order || !sorted_order) {
+		mem_free(mem, keys, keys_size);
+		mem_free(mem, sorted_keys, keys_size);
+		mem_free(mem, order, order_size);
+		mem_free(mem, sorted_order, order_size);
+		return 0;
+	}
+
+	for (size_t i = 0; i < count; i++) {
+		keys[i] = morton_code(seeds[i].x, seeds[i].y);
+		order[i] = i;
+		all_bits |= keys[i];
+	}
+
+	for (int shift = 0; shift < 64 && (all_bits >> shift); shift += digit_bits) {
+		size_t offsets[buckets] = { 0 };
+
+		for (size_t i = 0; i < count; i++) {
+			offsets[(keys[i] >> shift) & (buckets - 1)]++;
+		}
+
+		size_t total = 0;
+
+		for (size_t b = 0; b < buckets; b++) {
+			size_t n = offsets[b];
+			offsets[b] = total;
+			total += n;
+		}
+
+		for (size_t i = 0; i < count; i++) {
+			size_t to = offsets[(keys[i] >> shift) & (buckets - 1)]++;
+			sorted_keys[to] = keys[i];
+			sorted_order[to] = order[i];
+		}
+
+		uint64_t* swap_keys = keys;
+		keys = sorted_keys;
+		sorted_keys = swap_keys;
+
+		uint32_t* swap_order = order;
+		order = sorted_order;
+		sorted_order = swap_order;
+	}
+
+	mem_free(mem, keys, keys_size);
+	mem_free(mem, sorted_keys, keys_size);
+	mem_free(mem, sorted_order, order_size);
+
+	// Move the seeds and colors into place.
+	Point* moved_seeds = mem_alloc(mem, sizeof(Point) * count);
+	Rgb* moved_colors = mem_alloc(mem, sizeof(Rgb) * count);
+	int moved = moved_seeds && moved_colors;
+
+	if (moved) {
+		for (size_t i = 0; i < count; i++) {
+			moved_seeds[i] = seeds[order[i]];
+			moved_colors[i] = colors[order[i]];
+		}
+
+		memcpy(seeds, moved_seeds, sizeof(Point) * count);
+		memcpy(colors, moved_colors, sizeof(Rgb) * count);
+	}
+
+	mem_free(mem, moved_seeds, sizeof(Point) * count);
+	mem_free(mem, moved_colors, sizeof(Rgb) * count);
+	mem_free(mem, order, order_size);
+	return moved;
+}
+
+/**
+ * Interleave the bits of the given coordinates,
+ * with the bits of x in the even positions.
+ */
+static inline uint64_t morton_code(uint32_t x, uint32_t y) {
+	uint64_t code[] = { x, y };
+
+	for (int i = 0; i < 2; i++) {
+		code[i] = (code[i] | (code[i] << 16)) & 0x0000FFFF0000FFFF;
+		code[i] = (code[i] | (code[i] << 8))  & 0x00FF00FF00FF00FF;
+		code[i] = (code[i] | (code[i] << 4))  & 0x0F0F0F0F0F0F0F0F;
+		code[i] = (code[i] | (code[i] << 2))  & 0x3333333333333333;
+		code[i] = (code[i] | (code[i] << 1))  & 0x5555555555555555;
+	}
+
+	return code[0] | (code[1] << 1);
+}
+
+/**
+ * Start measuring the time and, on linux,
+ * the cache misses of the calling thread.
+ */
+void probe_start(Probe* probe) {
+	probe->fd = -1;
+
+#ifdef __linux__
+	struct perf_event_attr attr;
+	memset(&attr, 0, sizeof(attr));
+	attr.type = PERF_TYPE_HARDWARE;
+	attr.size = sizeof(attr);
+	attr.config = PERF_COUNT_HW_CACHE_MISSES;
+	attr.disabled = 1;
+	attr.inherit = 1;
+	attr.exclude_kernel = 1;
+	attr.exclude_hv = 1;
+
+	probe->fd = syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+
+	if (probe->fd >= 0) {
+		ioctl(probe->fd, PERF_EVENT_IOC_RESET, 0);
+		ioctl(probe->fd, PERF_EVENT_IOC_ENABLE, 0);
+	}
+#endif
+
+	timespec_get(&probe->start, TIME_UTC);
+}
+
+/**
+ * Stop measuring and print the results under the given label
+ * to the given log, if there is one.
+ */
+void probe_stop(Probe* probe, FILE* log, const char* label) {
+	struct timespec end;
+	timespec_get(&end, TIME_UTC);
+
+	double seconds = (end.tv_sec - probe->start.tv_sec)
+		+ (end.tv_nsec - probe->start.tv_nsec) / 1e9;
+
+	if (probe->fd < 0) {
+		if (log) {
+			fprintf(log, "%-12s: %.3f s\n", label, seconds);
+		}
+
+		return;
+	}
+
+	uint64_t misses = 0;
+
+#ifdef __linux__
+	ioctl(probe->fd, PERF_EVENT_IOC_DISABLE, 0);
+
+	if (read(probe->fd, &misses, sizeof(misses)) != sizeof(misses)) {
+		misses = 0;
+	}
+
+	close(probe->fd);
+#endif
+
+	if (log) {
+		fprintf(
+			log, "%-12s: %.3f s, %llu cache misses\n",
+			label, seconds, (unsigned long long) misses
+		);
+	}
+}
+
+/**
+ * Find spots appropriate for seeds that will be later used
+ * to stylize an image, one at the center of every leaf of its quadtree.
+ *
+ * The seeds are added to the given list in the order of the leaves.
+ *
+ * Returns 0 if it runs out of memory.
+ */
+int find_seeds(const QuadTree* tree, SeedList* seeds) {
+	if (!seed_list_reserve(seeds, seeds->count + tree->count)) {
+		return 0;
+	}
+
+	for (size_t i = 0; i < tree->count; i++) {
+		const QuadNode* leaf = &tree->leaves[i];
+
+		seed_list_push(seeds, (Point) {
+			leaf->x + leaf->width / 2,
+			leaf->y + leaf->height / 2
+		});
+	}
+
+	return 1;
+}
+
+/**
+ * Build the quadtree of the given image based on its edges.
+ *
+ * The image is subdivided into four quadrants each time it doesn't
+ * satisfy a condition. In this case, that means being an area of pixels
+ * that are all edges or all not edges.
+ *
+ * The condition is checked in constant time by counting the edges
+ * of the area in a summed-area table.
+ *
+ * The tree is built one level at a time, checking all of the nodes of
+ * a level in parallel, and only its leaves are kept, sorted by their
+ * morton codes. That is the order a depth-first search would visit them.
+ *
+ * Returns 0 if it runs out of memory, leaving the tree empty.
+ */
+int build_quadtree(Memory* mem, QuadTree* tree, const SplitTest* test) {
+	const size_t width = test->width;
+	const size_t height = test->height;
+
+	*tree = (QuadTree) { mem, width, height, NULL, 0, 0 };
+
+	size_t count = 1;
+	QuadNode* level = mem_alloc(mem, sizeof(QuadNode));
+	int ok = level != NULL;
+
+	if (ok) {
+		level[0] = (QuadNode) { 0, 0, 0, width, height, 0, 0 };
+	}
+
+	while (ok && count > 0) {
+		// How many children each node has, or 0 for leaves.
+		size_t* offsets = mem_alloc(mem, sizeof(size_t) * (count + 1));
+
+		if (!offsets) {
+			ok = 0;
+			break;
+		}
+
+		#pragma omp parallel for schedule(static)
+		for (size_t i = 0; i < count; i++) {
+			QuadNode* node = &level[i];
+
+			// Check if this sector of the image is uniform.
+			if (node_is_uniform(test, node, node_score(test, node))) {
+				node->value = node_value(test, node);
+				offsets[i] = 0;
+			} else {
+				// See split_node().
+				offsets[i] = node->width > 1 && node->height > 1 ? 4 : 2;
+			}
+		}
+
+		size_t children = 0;
+
+		for (size_t i = 0; i < count; i++) {
+			size_t n = offsets[i];
+			offsets[i] = children;
+			children += n;
+
+			if (n == 0 && ok) {
+				ok = quadtree_push(tree, level[i]);
+			}
+		}
+
+		offsets[count] = children;
+		QuadNode* next = NULL;
+
+		if (ok && children > 0) {
+			next = mem_alloc(mem, sizeof(QuadNode) * children);
+			ok = next != NULL;
+		}
+
+		// If not, divide it further into four sectors.
+		if (ok) {
+			#pragma omp parallel for schedule(static)
+			for (size_t i = 0; i < count; i++) {
+				if (offsets[i] == offsets[i + 1]) {
+					continue;
+				}
+
+				split_node(&level[i], &next[offsets[i]]);
+			}
+		}
+
+		mem_free(mem, offsets, sizeof(size_t) * (count + 1));
+		mem_free(mem, level, sizeof(QuadNode) * count);
+		level = next;
+		count = children;
+	}
+
+	mem_free(mem, level, sizeof(QuadNode) * count);
+
+	if (!ok) {
+		free_quadtree(tree);
+		return 0;
+	}
+
+	qsort(tree->leaves, tree->count, sizeof(QuadNode), compare_nodes);
+	return 1;
+}
+
+/**
+ * Build a quadtree of the given image with exactly the given number
+ * of leaves, or one per pixel if the image has fewer pixels than that.
+ *
+ * Instead of subdividing every sector that is not uniform, this always
+ * splits the leaf that is the furthest from being uniform, so detail is
+ * spread over the whole image. Once every leaf is uniform, the largest
+ * ones are split until the budget is spent.
+ *
+ * If splitting the last leaf would go over the budget, only its least
+ * uniform quadrants are kept, and the pixels of the rest belong to no leaf.
+ *
+ * See also: https://en.wikipedia.org/wiki/Best-first_search
+ *
+ * Returns 0 if it runs out of memory, leaving the tree empty.
+ */
+int build_quadtree_budget(
+	Memory* mem, QuadTree* tree, const SplitTest* test, size_t budget
+) {
+	const size_t width = test->width;
+	const size_t height = test->height;
+
+	*tree = (QuadTree) { mem, width, height, NULL, 0, 0 };
+
+	if (budget > width * height) {
+		budget = width * height;
+	}
+
+	// The leaves are kept in a max-heap ordered by split priority.
+	const size_t heap_size = sizeof(RankedNode) * (budget + 3);
+	RankedNode* heap = mem_alloc(mem, heap_size);
+	size_t count = 0;
+
+	if (!heap) {
+		return 0;
+	}
+
+	QuadNode root = { 0, 0, 0, width, height, 0, 0 };
+	heap_push(heap, &count, rank_node(test, root));
+
+	while (count < budget && heap[0].node.width * heap[0].node.height > 1) {
+		RankedNode parent = heap_pop(heap, &count);
+		QuadNode quadrants[4];
+		RankedNode children[4];
+		int n = split_node(&parent.node, quadrants);
+
+		for (int i = 0; i < n; i++) {
+			children[i] = rank_node(test, quadrants[i]);
+		}
+
+		if (count + n > budget) {
+			// Keep the least uniform quadrants, in their original order.
+			size_t keep = budget - count;
+			qsort(children, n, sizeof(RankedNode), compare_ranks);
+			qsort(children, keep, sizeof(RankedNode), compare_codes);
+			n = keep;
+		}
+
+		for (int i = 0; i < n; i++) {
+			heap_push(heap, &count, children[i]);
+		}
+	}
+
+	int ok = 1;
+
+	for (size_t i = 0; i < count && ok; i++) {
+		QuadNode leaf = heap[i].node;
+		leaf.value = node_value(test, &leaf);
+		ok = quadtree_push(tree, leaf);
+	}
+
+	mem_free(mem, heap, heap_size);
+
+	if (!ok) {
+		free_quadtree(tree);
+		return 0;
+	}
+
+	qsort(tree->leaves, tree->count, sizeof(QuadNode), compare_nodes);
+	return 1;
+}
+
+/**
+ * Prepare a test that only lets sectors that are all edges
+ * or all not edges be leaves.
+ *
+ * Returns 0 if it runs out of memory.
+ */
+int init_edge_split(Memory* mem, SplitTest* test, ImageView edges) {
+	*test = (SplitTest) {
+		SPLIT_EDGES, edges.width, edges.height,
+		build_edge_table(mem, edges),
+		sizeof(uint32_t) * (edges.width + 1) * (edges.height + 1),
+		0
+	};
+
+	return test->table != NULL;
+}
+
+/**
+ * Prepare a test that only lets sectors whose color variance,
+ * added over the three channels, is within the tolerance be leaves.
+ *
+ * Returns 0 if it runs out of memory.
+ */
+int init_variance_split(
+	Memory* mem, SplitTest* test, ImageView in, double tolerance
+) {
+	*test = (SplitTest) {
+		SPLIT_VARIANCE, in.width, in.height,
+		build_color_table(mem, in),
+		sizeof(uint64_t) * 6 * (in.width + 1) * (in.height + 1),
+		tolerance
+	};
+
+	return test->table != NULL;
+}
+
+void free_split(Memory* mem, SplitTest* test) {
+	mem_free(mem, test->table, test->table_size);
+	test->table = NULL;
+}
+
+/**
+ * How far the given node is from being uniform.
+ *
+ * When splitting on edges, that is how many of its pixels disagree with
+ * the rest: the smaller of its number of edges and non edges.
+ * When splitting on variance, that is the sum of the squared
+ * differences between its pixels and their mean color.
+ */
+static double node_score(const SplitTest* test, const QuadNode* node) {
+	size_t end_x = node->x + node->width;
+	size_t end_y = node->y + node->height;
+	size_t area = (size_t) node->width * node->height;
+
+	if (test->mode == SPLIT_EDGES) {
+		uint32_t found = count_edges(
+			test->table, test->width, node->x, node->y, end_x, end_y
+		);
+
+		return found < area - found ? found : area - found;
+	}
+
+	uint64_t sums[6];
+	sum_colors(test->table, test->width, node->x, node->y, end_x, end_y, sums);
+	double score = 0;
+
+	for (int c = 0; c < 3; c++) {
+		double sum = sums[c];
+		score += sums[c + 3] - sum * sum / area;
+	}
+
+	return score > 0 ? score : 0;
+}
+
+/**
+ * Whether a node with the given score can be a leaf.
+ */
+static int node_is_uniform(
+	const SplitTest* test, const QuadNode* node, double score
+) {
+	if (test->mode == SPLIT_EDGES) {
+		return score == 0;
+	}
+
+	return score <= test->tolerance * node->width * node->height;
+}
+
+/**
+ * The value of a leaf: whether most of its pixels are edges.
+ *
+ * Leaves split on variance don't look at edges and are always 0.
+ */
+static uint8_t node_value(const SplitTest* test, const QuadNode* node) {
+	if (test->mode != SPLIT_EDGES) {
+		return 0;
+	}
+
+	uint32_t found = count_edges(
+		test->table, test->width,
+		node->x, node->y, node->x + node->width, node->y + node->height
+	);
+
+	return 2 * (size_t) found >= (size_t) node->width * node->height;
+}
+
+/**
+ * Divide the given node into its quadrants,
+ * writing them to the given array in morton order.
+ *
+ * Sectors that are a single pixel wide or tall only have two halves.
+ *
+ * Returns the number of quadrants.
+ */
+static int split_node(const QuadNode* node, QuadNode children[4]) {
+	uint32_t middle_x = node->x + node->width / 2;
+	uint32_t middle_y = node->y + node->height / 2;
+	uint32_t end_x = node->x + node->width;
+	uint32_t end_y = node->y + node->height;
+	int count = 0;
+
+	uint32_t boundaries[][4] = {
+		{ node->x,  node->y,  middle_x, middle_y },
+		{ middle_x, node->y,  end_x,    middle_y },
+		{ node->x,  middle_y, middle_x, end_y },
+		{ middle_x, middle_y, end_x,    end_y }
+	};
+
+	for (uint64_t q = 0; q < 4; q++) {
+		if (boundaries[q][0] == boundaries[q][2]
+				|| boundaries[q][1] == boundaries[q][3]) {
+			continue;
+		}
+
+		children[count++] = (QuadNode) {
+			(node->code << 2) | q,
+			boundaries[q][0],
+			boundaries[q][1],
+			boundaries[q][2] - boundaries[q][0],
+			boundaries[q][3] - boundaries[q][1],
+			node->level + 1,
+			0
+		};
+	}
+
+	return count;
+}
+
+/**
+ * Pair a node with how far it is from being uniform.
+ */
+static RankedNode rank_node(const SplitTest* test, QuadNode node) {
+	return (RankedNode) { node, node_score(test, &node) };
+}
+
+/**
+ * Whether the first node should be split before the second one:
+ * the least uniform one first, then the largest one.
+ */
+static inline int ranks_before(const RankedNode* a, const RankedNode* b) {
+	if (a->score != b->score) {
+		return a->score > b->score;
+	}
+
+	return (size_t) a->node.width * a->node.height
+		> (size_t) b->node.width * b->node.height;
+}
+
+static int compare_ranks(const void* a, const void* b) {
+	return ranks_before(b, a) - ranks_before(a, b);
+}
+
+static int compare_codes(const void* a, const void* b) {
+	uint64_t code_a = ((const RankedNode*) a)->node.code;
+	uint64_t code_b = ((const RankedNode*) b)->node.code;
+	return (code_a > code_b) - (code_a < code_b);
+}
+
+static void heap_push(RankedNode* heap, size_t* count, RankedNode node) {
+	size_t i = (*count)++;
+
+	while (i > 0 && ranks_before(&node, &heap[(i - 1) / 2])) {
+		heap[i] = heap[(i - 1) / 2];
+		i = (i - 1) / 2;
+	}
+
+	heap[i] = node;
+}
+
+static RankedNode heap_pop(RankedNode* heap, size_t* count) {
+	RankedNode top = heap[0];
+	RankedNode last = heap[--(*count)];
+	size_t i = 0;
+
+	while (2*i + 1 < *count) {
+		size_t child = 2*i + 1;
+
+		if (child + 1 < *count && ranks_before(&heap[child + 1], &heap[child])) {
+			child++;
+		}
+
+		if (!ranks_before(&heap[child], &last)) {
+			break;
+		}
+
+		heap[i] = heap[child];
+		i = child;
+	}
+
+	heap[i] = last;
+	return top;
+}
+
+void free_quadtree(QuadTree* tree) {
+	mem_free(tree->mem, tree->leaves, sizeof(QuadNode) * tree->capacity);
+	tree->leaves = NULL;
+	tree->count = 0;
+	tree->capacity = 0;
+}
+
+/**
+ * Write the leaves of the given tree to a file,
+ * so they can be reused to stylize the image again.
+ *
+ * Returns 0 if the file couldn't be written.
+ */
+int save_quadtree(const QuadTree* tree, const char* path) {
+	FILE* file = fopen(path, "wb");
+
+	if (!file) {
+		return 0;
+	}
+
+	uint32_t header[] = {
+		quadtree_magic, tree->width, tree->height, tree->count
+	};
+	int ok = fwrite(header, sizeof(header), 1, file) == 1;
+
+	for (size_t i = 0; i < tree->count && ok; i++) {
+		const QuadNode* leaf = &tree->leaves[i];
+		uint32_t extent[] = { leaf->x, leaf->y, leaf->width, leaf->height };
+		uint8_t info[] = { leaf->level, leaf->value };
+
+		ok = fwrite(&leaf->code, sizeof(leaf->code), 1, file) == 1
+			&& fwrite(extent, sizeof(extent), 1, file) == 1
+			&& fwrite(info, sizeof(info), 1, file) == 1;
+	}
+
+	return fclose(file) == 0 && ok;
+}
+
+/**
+ * Read the leaves of a tree written by save_quadtree().
+ *
+ * Returns ARTISTIC_TREE_UNREADABLE if the file couldn't be read,
+ * or if it holds no leaves, more or fewer leaves than its header says,
+ * or leaves that aren't sectors of its image in strict morton order.
+ */
+ArtisticStatus load_quadtree(Memory* mem, QuadTree* tree, const char* path) {
+	FILE* file = fopen(path, "rb");
+	uint32_t header[4];
+
+	*tree = (QuadTree) { mem, 0, 0, NULL, 0, 0 };
+
+	if (!file) {
+		return ARTISTIC_TREE_UNREADABLE;
+	}
+
+	if (fread(header, sizeof(header), 1, file) != 1
+			|| header[0] != quadtree_magic
+			|| header[3] == 0
+			|| header[3] > (uint64_t) header[1] * header[2]) {
+		fclose(file);
+		return ARTISTIC_TREE_UNREADABLE;
+	}
+
+	tree->width = header[1];
+	tree->height = header[2];
+	ArtisticStatus status = ARTISTIC_OK;
+
+	for (size_t i = 0; i < header[3] && status == ARTISTIC_OK; i++) {
+		QuadNode leaf;
+		uint32_t extent[4];
+		uint8_t info[2];
+
+		int ok = fread(&leaf.code, sizeof(leaf.code), 1, file) == 1
+			&& fread(extent, sizeof(extent), 1, file) == 1
+			&& fread(info, sizeof(info), 1, file) == 1;
+
+		leaf.x = extent[0];
+		leaf.y = extent[1];
+		leaf.width = extent[2];
+		leaf.height = extent[3];
+		leaf.level = info[0];
+		leaf.value = info[1];
+
+		if (!ok || !valid_leaf(tree, &leaf)) {
+			status = ARTISTIC_TREE_UNREADABLE;
+		} else if (!quadtree_push(tree, leaf)) {
+			status = ARTISTIC_OUT_OF_MEMORY;
+		}
+	}
+
+	// Anything past the last leaf means the count in the header is wrong.
+	if (status == ARTISTIC_OK && fgetc(file) != EOF) {
+		status = ARTISTIC_TREE_UNREADABLE;
+	}
+
+	fclose(file);
+
+	if (status != ARTISTIC_OK) {
+		free_quadtree(tree);
+	}
+
+	return status;
+}
+
+/**
+ * Check that a leaf read from a file is the sector of the image of the
+ * given tree that its morton code stands for, and that it comes after
+ * every pixel of the last leaf of the tree in morton order, which
+ * keeps leaves sorted and apart from each other.
+ */
+static int valid_leaf(const QuadTree* tree, const QuadNode* leaf) {
+	if (leaf->level > quadtree_max_depth
+			|| leaf->code >> 2*leaf->level != 0
+			|| !is_sector(tree, leaf)) {
+		return 0;
+	}
+
+	if (tree->count == 0) {
+		return 1;
+	}
+
+	const QuadNode* last = &tree->leaves[tree->count - 1];
+	uint64_t last_span = (uint64_t) 1 << 2*(quadtree_max_depth - last->level);
+	return node_key(leaf) >= node_key(last) + last_span;
+}
+
+/**
+ * Whether the extent of the given leaf is the one of the sector
+ * that the quadtree of its image splits off at its morton code.
+ */
+static int is_sector(const QuadTree* tree, const QuadNode* leaf) {
+	QuadNode node = { 0, 0, 0, tree->width, tree->height, 0, 0 };
+
+	while (node.level < leaf->level) {
+		QuadNode children[4];
+		int count = split_node(&node, children);
+		uint64_t code = leaf->code >> 2*(leaf->level - node.level - 1);
+		int found = 0;
+
+		for (int i = 0; i < count && !found; i++) {
+			if (children[i].code == code) {
+				node = children[i];
+				found = 1;
+			}
+		}
+
+		if (!found) {
+			return 0;
+		}
+	}
+
+	return leaf->x == node.x && leaf->y == node.y
+		&& leaf->width == node.width && leaf->height == node.height;
+}
+
+/**
+ * Add a leaf to the end of the given tree, growing it if needed.
+ *
+ * Returns 0 if it runs out of memory, leaving the tree as it was.
+ */
+static int quadtree_push(QuadTree* tree, QuadNode leaf) {
+	if (tree->count == tree->capacity) {
+		size_t capacity = tree->capacity ? tree->capacity * 2 : 64;
+		QuadNode* leaves = mem_alloc(tree->mem, sizeof(QuadNode) * capacity);
+
+		if (!leaves) {
+			return 0;
+		}
+
+		if (tree->count > 0) {
+			memcpy(leaves, tree->leaves, sizeof(QuadNode) * tree->count);
+		}
+
+		mem_free(
+			tree->mem, tree->leaves, sizeof(QuadNode) * tree->capacity
+		);
+
+		tree->leaves = leaves;
+		tree->capacity = capacity;
+	}
+
+	tree->leaves[tree->count++] = leaf;
+	return 1;
+}
+
+/**
+ * The morton code of a node, aligned to the deepest level of the tree,
+ * so that codes of different levels can be compared.
+ */
+static inline uint64_t node_key(const QuadNode* node) {
+	return node->code << 2*(quadtree_max_depth - node->level);
+}
+
+static int compare_nodes(const void* a, const void* b) {
+	uint64_t key_a = node_key(a);
+	uint64_t key_b = node_key(b);
+	return (key_a > key_b) - (key_a < key_b);
+}
+
+/**
+ * Place seeds with poisson-disk sampling, so that no two of them are
+ * closer than a radius that shrinks near edges.
+ *
+ * This gives evenly spread seeds that don't follow the quadtree's grid,
+ * dense around edges and sparse in flat areas of the image.
+ *
+ * Samples grow outwards from the center of the image, each one trying
+ * to place new ones around it until it fails a number of times in a row.
+ * A background grid with at most one sample per cell makes checking
+ * the neighbors of a candidate take constant time.
+ *
+ * See also: https://www.cs.ubc.ca/~rbridson/docs/bridson-siggraph07-poissondisk.pdf
+ *
+ * Returns 0 if it runs out of memory.
+ */
+int place_poisson_seeds(
+	Memory* mem, SeedList* seeds, ImageView edges,
+	float min_radius, float max_radius
+) {
+	enum { attempts = 30 };
+	const size_t width = edges.width;
+	const size_t height = edges.height;
+	const size_t table_size = sizeof(uint32_t) * (width + 1) * (height + 1);
+	uint32_t* table = build_edge_table(mem, edges);
+
+	// Cells are small enough that two samples never share one.
+	const float cell = min_radius / sqrtf(2);
+	const size_t grid_width = ceilf(width / cell);
+	const size_t grid_height = ceilf(height / cell);
+	const size_t grid_size = sizeof(uint32_t) * grid_width * grid_height;
+	// Index of the sample in every cell plus one, or 0 if it is empty.
+	uint32_t* grid = mem_alloc(mem, grid_size);
+	uint32_t* active = mem_alloc(mem, grid_size);
+	size_t active_count = 0;
+	uint64_t random = 0x9E3779B97F4A7C15;
+
+	Point first = { width / 2, height / 2 };
+	size_t start = seeds->count;
+	int ok = table && grid && active && seed_list_push(seeds, first);
+
+	if (ok) {
+		memset(grid, 0, grid_size);
+		grid[(size_t) (first.y / cell) * grid_width
+			+ (size_t) (first.x / cell)] = 1;
+		active[active_count++] = 0;
+	}
+
+	while (ok && active_count > 0) {
+		size_t slot = next_random(&random) % active_count;
+		Point sample = seeds->data[start + active[slot]];
+		float radius = poisson_radius(
+			table, width, height, sample, min_radius, max_radius
+		);
+		int placed = 0;
+
+		for (int attempt = 0; attempt < attempts && !placed; attempt++) {
+			// Pick a candidate between one and two radii away.
+			float angle = 2 * M_PI * random_unit(&random);
+			float distance = radius * (1 + random_unit(&random));
+			float x = sample.x + distance * cosf(angle);
+			float y = sample.y + distance * sinf(angle);
+
+			if (x < 0 || y < 0 || x >= width || y >= height) {
+				continue;
+			}
+
+			Point candidate = { x, y };
+			float candidate_radius = poisson_radius(
+				table, width, height, candidate, min_radius, max_radius
+			);
+
+			// Neighbors keep the average of both radii between them,
+			// so look as far as the largest one could need.
+			float reach = (candidate_radius + max_radius) / 2;
+			long cx = candidate.x / cell;
+			long cy = candidate.y / cell;
+			long cells = ceilf(reach / cell);
+			int clear = 1;
+
+			for (long gy = cy - cells; gy <= cy + cells && clear; gy++) {
+				if (gy < 0 || gy >= (long) grid_height) {
+					continue;
+				}
+
+				for (long gx = cx - cells; gx <= cx + cells; gx++) {
+					if (gx < 0 || gx >= (long) grid_width) {
+						continue;
+					}
+
+					uint32_t other = grid[gy*grid_width + gx];
+
+					if (!other) {
+						continue;
+					}
+
+					Point neighbor = seeds->data[start + other - 1];
+					float dx = (float) neighbor.x - candidate.x;
+					float dy = (float) neighbor.y - candidate.y;
+					float spacing = (candidate_radius + poisson_radius(
+						table, width, height, neighbor, min_radius, max_radius
+					)) / 2;
+
+					if (dx*dx + dy*dy < spacing*spacing) {
+						clear = 0;
+						break;
+					}
+				}
+			}
+
+			if (clear) {
+				size_t index = seeds->count - start;
+
+				if (!seed_list_push(seeds, candidate)) {
+					ok = 0;
+					break;
+				}
+
+				grid[cy*grid_width + cx] = index + 1;
+				active[active_count++] = index;
+				placed = 1;
+			}
+		}
+
+		// Samples that have no room left around them stop being active.
+		if (!placed) {
+			active[slot] = active[--active_count];
+		}
+	}
+
+	mem_free(mem, active, grid_size);
+	mem_free(mem, grid, grid_size);
+	mem_free(mem, table, table_size);
+	return ok;
+}
+
+/**
+ * Place the given number of seeds at random pixels, each pixel being
+ * picked with a probability proportional to its gradient magnitude.
+ *
+ * A small share of the probability is spread evenly over the image,
+ * so that flat areas still get a few large cells.
+ *
+ * Pixels are drawn from an alias table, which takes linear time
+ * to build and constant time per sample. Pixels that were already
+ * picked are drawn again.
+ *
+ * See also: https://www.keithschwarz.com/darts-dice-coins/
+ *
+ * Returns 0 if it runs out of memory.
+ */
+int place_importance_seeds(
+	Memory* mem, SeedList* seeds,
+	size_t width, size_t height, const uint32_t* magnitudes,
+	size_t count
+) {
+	const size_t pixels = width * height;
+	const size_t weights_size = sizeof(float) * pixels;
+	const size_t alias_size = sizeof(uint32_t) * pixels;
+	// Pixels that already have a seed, one bit each.
+	const size_t taken_size = sizeof(uint64_t) * ((pixels + 63) / 64);
+	float* weights = mem_alloc(mem, weights_size);
+	uint32_t* alias = mem_alloc(mem, alias_size);
+	uint64_t* taken = mem_alloc(mem, taken_size);
+	double total = 0;
+
+	if (count > pixels) {
+		count = pixels;
+	}
+
+	if (!weights || !alias || !taken
+			|| !seed_list_reserve(seeds, seeds->count + count)) {
+		mem_free(mem, taken, taken_size);
+		mem_free(mem, alias, alias_size);
+		mem_free(mem, weights, weights_size);
+		return 0;
+	}
+
+	#pragma omp parallel for schedule(static) reduction(+:total)
+	for (size_t i = 0; i < pixels; i++) {
+		weights[i] = sqrtf(magnitudes[i]);
+		total += weights[i];
+	}
+
+	// Scale the weights so that they average to one.
+	const float floor = importance_floor * total / pixels;
+	const float scale = pixels / (total + floor * pixels);
+
+	#pragma omp parallel for schedule(static)
+	for (size_t i = 0; i < pixels; i++) {
+		weights[i] = (weights[i] + floor) * scale;
+	}
+
+	int ok = build_alias_table(mem, weights, alias, pixels);
+	uint64_t random = 0x9E3779B97F4A7C15;
+
+	memset(taken, 0, taken_size);
+
+	for (size_t placed = 0; placed < count && ok;) {
+		size_t i = next_random(&random) % pixels;
+
+		if (random_unit(&random) >= weights[i]) {
+			i = alias[i];
+		}
+
+		if (taken[i / 64] & (1ull << (i % 64))) {
+			continue;
+		}
+
+		taken[i / 64] |= 1ull << (i % 64);
+		seed_list_push(seeds, (Point) { i % width, i / width });
+		placed++;
+	}
+
+	mem_free(mem, taken, taken_size);
+	mem_free(mem, alias, alias_size);
+	mem_free(mem, weights, weights_size);
+	return ok;
+}
+
+/**
+ * Turn the given weights, which must average to one, into an alias table.
+ *
+ * Afterwards, weights[i] is the probability of keeping entry i
+ * once it is drawn, and alias[i] the entry to pick otherwise.
+ *
+ * This is Vose's method, which pairs every entry below one
+ * with an entry above one that gives it the rest of its probability.
+ *
+ * Returns 0 if it runs out of memory.
+ */
+static int build_alias_table(
+	Memory* mem, float* weights, uint32_t* alias, size_t count
+) {
+	const size_t worklist_size = sizeof(uint32_t) * count;
+	// Entries below one fill the worklist from the start,
+	// and entries above it fill the worklist from the end.
+	uint32_t* worklist = mem_alloc(mem, worklist_size);
+	size_t small = 0, large = count;
+
+	if (!worklist) {
+		return 0;
+	}
+
+	for (size_t i = 0; i < count; i++) {
+		if (weights[i] < 1) {
+			worklist[small++] = i;
+		} else {
+			worklist[--large] = i;
+		}
+	}
+
+	while (small > 0 && large < count) {
+		uint32_t less = worklist[--small];
+		uint32_t more = worklist[large++];
+
+		alias[less] = more;
+		weights[more] -= 1 - weights[less];
+
+		if (weights[more] < 1) {
+			worklist[small++] = more;
+		} else {
+			worklist[--large] = more;
+		}
+	}
+
+	// Whatever is left is one, give or take rounding errors.
+	while (small > 0) {
+		weights[worklist[--small]] = 1;
+	}
+
+	while (large < count) {
+		weights[worklist[large++]] = 1;
+	}
+
+	mem_free(mem, worklist, worklist_size);
+	return 1;
+}
+
+/**
+ * How far apart poisson-disk samples should be around the given point.
+ *
+ * The radius goes from the largest one in areas without edges
+ * to the smallest one once there are enough edges around the point
+ * to cross the whole area.
+ */
+static float poisson_radius(
+	const uint32_t* table, size_t width, size_t height,
+	Point p, float min_radius, float max_radius
+) {
+	size_t reach = max_radius;
+	size_t start_x = p.x > reach ? p.x - reach : 0;
+	size_t start_y = p.y > reach ? p.y - reach : 0;
+	size_t end_x = p.x + reach + 1 < width ? p.x + reach + 1 : width;
+	size_t end_y = p.y + reach + 1 < height ? p.y + reach + 1 : height;
+
+	float found = count_edges(table, width, start_x, start_y, end_x, end_y);
+	float density = found / (2*reach + 1);
+
+	if (density > 1) {
+		density = 1;
+	}
+
+	return max_radius - (max_radius - min_radius) * density;
+}
+
+/**
+ * Generate a pseudorandom number, advancing the given state.
+ *
+ * See also: https://en.wikipedia.org/wiki/Xorshift#xorshift*
+ */
+static inline uint64_t next_random(uint64_t* state) {
+	*state ^= *state >> 12;
+	*state ^= *state << 25;
+	*state ^= *state >> 27;
+	return *state * 0x2545F4914F6CDD1D;
+}
+
+/**
+ * Generate a pseudorandom number between 0 (inclusive) and 1 (exclusive).
+ */
+static inline float random_unit(uint64_t* state) {
+	return (next_random(state) >> 40) / (float) (1 << 24);
+}
+
+/**
+ * Place one seed in every connected region of pixels that are not edges.
+ *
+ * Regions are labeled with a union-find over the pixels: strips of rows
+ * are joined on their own in parallel, then stitched together along their
+ * borders. Every root is the first pixel of its region, so a single pass
+ * in order is enough to give every pixel the number of its region.
+ *
+ * The frame around the image is left out, since edge detection can't
+ * reach it.
+ *
+ * Each seed goes to the centroid of its region, or to the pixel of the
+ * region closest to it when the region wraps around its centroid.
+ *
+ * Returns 0 if it runs out of memory.
+ */
+int place_component_seeds(Memory* mem, SeedList* seeds, ImageView edges) {
+	const size_t width = edges.width;
+	const size_t height = edges.height;
+	const size_t pixels = width * height;
+	const size_t labels_size = sizeof(uint32_t) * pixels;
+	const size_t strips = (height + component_strip - 1) / component_strip;
+	uint32_t* labels = mem_alloc(mem, labels_size);
+
+	if (!labels) {
+		return 0;
+	}
+
+	// Join every pixel with its neighbors above and to the left
+	// that are in the same strip.
+	#pragma omp parallel for schedule(dynamic)
+	for (size_t s = 0; s < strips; s++) {
+		size_t start = s * component_strip;
+		size_t end = start + component_strip < height
+			? start + component_strip : height;
+		ImageView strip = crop_view(edges, 0, start, width, end - start);
+
+		for (size_t y = start; y < end; y++) {
+			const Rgb* line = view_row(strip, y - start);
+
+			for (size_t x = 0; x < width; x++) {
+				uint32_t i = y * width + x;
+
+				if (line[x].r != 0 || x < component_frame
+						|| y < component_frame || x + component_frame >= width
+						|| y + component_frame >= height) {
+					labels[i] = no_component;
+					continue;
+				}
+
+				labels[i] = i;
+
+				if (x > 0 && labels[i - 1] != no_component) {
+					join_components(labels, i - 1, i);
+				}
+
+				if (y > start && labels[i - width] != no_component) {
+					join_components(labels, i - width, i);
+				}
+			}
+		}
+	}
+
+	// Stitch the strips together.
+	for (size_t s = 1; s < strips; s++) {
+		size_t y = s * component_strip;
+
+		for (size_t x = 0; x < width; x++) {
+			uint32_t i = y * width + x;
+
+			if (labels[i] != no_component && labels[i - width] != no_component) {
+				join_components(labels, i - width, i);
+			}
+		}
+	}
+
+	// Number the regions. Since parents always come first, the parent
+	// of a pixel already holds the number of its region by the time it
+	// is reached.
+	size_t count = 0;
+
+	for (uint32_t i = 0; i < pixels; i++) {
+		if (labels[i] == no_component) {
+			continue;
+		}
+
+		labels[i] = labels[i] == i ? count++ : labels[labels[i]];
+	}
+
+	if (count == 0) {
+		mem_free(mem, labels, labels_size);
+		return 1;
+	}
+
+	const size_t components_size = sizeof(Component) * count;
+	Component* components = mem_alloc(mem, components_size);
+
+	if (!components || !seed_list_reserve(seeds, seeds->count + count)) {
+		mem_free(mem, components, components_size);
+		mem_free(mem, labels, labels_size);
+		return 0;
+	}
+
+	memset(components, 0, components_size);
+
+	for (size_t y = 0; y < height; y++) {
+		for (size_t x = 0; x < width; x++) {
+			uint32_t label = labels[y * width + x];
+
+			if (label != no_component) {
+				components[label].sum_x += x;
+				components[label].sum_y += y;
+				components[label].size++;
+			}
+		}
+	}
+
+	// Put the seeds on the centroids, and mark the regions
+	// that don't contain their own.
+	int wrapped = 0;
+
+	for (size_t c = 0; c < count; c++) {
+		Component* component = &components[c];
+		size_t half = component->size / 2;
+		size_t x = (component->sum_x + half) / component->size;
+		size_t y = (component->sum_y + half) / component->size;
+
+		component->seed = (Point) { x, y };
+		component->distance = labels[y * width + x] == c ? 0 : INFINITY;
+		wrapped |= component->distance != 0;
+	}
+
+	// Move the seeds of those regions to their pixel
+	// closest to the centroid.
+	if (wrapped) {
+		for (size_t y = 0; y < height; y++) {
+			for (size_t x = 0; x < width; x++) {
+				uint32_t label = labels[y * width + x];
+
+				if (label == no_component || components[label].distance == 0) {
+					continue;
+				}
+
+				Component* component = &components[label];
+				double cx = (double) component->sum_x / component->size;
+				double cy = (double) component->sum_y / component->size;
+				double distance = (x - cx) * (x - cx) + (y - cy) * (y - cy);
+
+				if (distance < component->distance) {
+					component->seed = (Point) { x, y };
+					component->distance = distance;
+				}
+			}
+		}
+	}
+
+	for (size_t c = 0; c < count; c++) {
+		seed_list_push(seeds, components[c].seed);
+	}
+
+	mem_free(mem, components, components_size);
+	mem_free(mem, labels, labels_size);
+	return 1;
+}
+
+/**
+ * Place the given number of seeds, or one per pixel if the image has
+ * fewer pixels than that, on the centers of SLIC superpixels.
+ *
+ * Centers start on a regular grid with about one cell per seed, then every
+ * pixel joins the center closest to it in color and position, and the
+ * centers move to the mean of their pixels. Centers stay close to their
+ * cell, so every pixel only looks at the centers of its own cell and of the
+ * cells around it, which is about a window twice the grid step wide.
+ *
+ * The grid has less than a row or a column of cells more than there are
+ * seeds to place, and the smallest superpixels are left without a seed.
+ *
+ * The image is read from planes of its channels, so that a run of pixels
+ * of the same cell is compared to each center with full width vector
+ * loads, keeping the closest center of every pixel of the run.
+ *
+ * Returns 0 if it runs out of memory.
+ */
+int place_slic_seeds(
+	Memory* mem, SeedList* seeds, ImageView in,
+	size_t count, float compactness
+) {
+	const size_t width = in.width;
+	const size_t height = in.height;
+
+	if (count == 0) {
+		count = 1;
+	} else if (count > width * height) {
+		count = width * height;
+	}
+
+	const float step = sqrtf((float) width * height / count);
+	// How much a pixel of distance weighs against a unit of color.
+	const float weight = (compactness / step) * (compactness / step);
+	size_t rows = fminf(fmaxf(1, roundf(height / step)), height);
+	size_t columns = (count + rows - 1) / rows;
+
+	if (columns > width) {
+		columns = width;
+		rows = (count + columns - 1) / columns;
+	}
+
+	const size_t cells = columns * rows;
+	const size_t centers_size = sizeof(SlicCenter) * cells;
+	const size_t sums_size = sizeof(SlicSum) * cells;
+	const size_t labels_size = sizeof(uint32_t) * width * height;
+	const size_t distances_size = sizeof(float) * width * height;
+	const size_t ranks_size = cells > count ? sizeof(SlicRank) * cells : 0;
+	SlicCenter* centers = mem_alloc(mem, centers_size);
+	SlicSum* sums = mem_alloc(mem, sums_size);
+	uint32_t* labels = mem_alloc(mem, labels_size);
+	float* distances = mem_alloc(mem, distances_size);
+	SlicRank* ranks = ranks_size ? mem_alloc(mem, ranks_size) : NULL;
+	ImageBuffer planes;
+
+	if (!image_buffer_init(mem, &planes, width, height, LAYOUT_PLANAR)
+			|| !centers || !sums || !labels || !distances
+			|| (ranks_size && !ranks)
+			|| !seed_list_reserve(seeds, seeds->count + count)) {
+		image_buffer_free(&planes);
+		mem_free(mem, ranks, ranks_size);
+		mem_free(mem, distances, distances_size);
+		mem_free(mem, labels, labels_size);
+		mem_free(mem, sums, sums_size);
+		mem_free(mem, centers, centers_size);
+		return 0;
+	}
+
+	image_buffer_from_rgb(&planes, in);
+
+	for (size_t gy = 0; gy < rows; gy++) {
+		for (size_t gx = 0; gx < columns; gx++) {
+			size_t x = (2 * gx + 1) * width / (2 * columns);
+			size_t y = (2 * gy + 1) * height / (2 * rows);
+			Rgb p = view_row(in, y)[x];
+
+			centers[gy * columns + gx] = (SlicCenter) { p.r, p.g, p.b, x, y };
+		}
+	}
+
+	for (int iteration = 0; iteration < slic_iterations; iteration++) {
+		// Assign every pixel to the closest center around its cell.
+		#pragma omp parallel for schedule(static)
+		for (size_t y = 0; y < height; y++) {
+			size_t gy = y * rows / height;
+			size_t start_gy = gy > 0 ? gy - 1 : 0;
+			size_t end_gy = gy + 1 < rows ? gy + 1 : rows - 1;
+			const uint8_t* r = image_buffer_row(&planes, 0, y);
+			const uint8_t* g = image_buffer_row(&planes, 1, y);
+			const uint8_t* b = image_buffer_row(&planes, 2, y);
+			uint32_t* line = labels + y * width;
+			float* best = distances + y * width;
+
+			for (size_t x = 0; x < width; x++) {
+				best[x] = INFINITY;
+				line[x] = gy * columns + x * columns / width;
+			}
+
+			// Every center is compared to the pixels of its own cell and of
+			// the cells on either side, the same centers in the same order
+			// as if each pixel went through the centers around it in turn.
+			for (size_t cy = start_gy; cy <= end_gy; cy++) {
+				for (size_t cx = 0; cx < columns; cx++) {
+					const SlicCenter c = centers[cy * columns + cx];
+					const uint32_t label = cy * columns + cx;
+					const float dy = y - c.y;
+					const float dy2 = dy * dy;
+					size_t start_gx = cx > 0 ? cx - 1 : 0;
+					size_t end_gx = cx + 2 < columns ? cx + 2 : columns;
+					int start = (start_gx * width + columns - 1) / columns;
+					int end = (end_gx * width + columns - 1) / columns;
+
+					for (int x = start; x < end; x++) {
+						float dr = r[x] - c.r;
+						float dg = g[x] - c.g;
+						float db = b[x] - c.b;
+						float dx = x - c.x;
+						float distance = dr * dr + dg * dg + db * db
+							+ weight * (dx * dx + dy2);
+						// A mask rather than a branch, which the compiler
+						// turns into vector selects.
+						uint32_t closer = -(uint32_t)(distance < best[x]);
+
+						line[x] = (label & closer) | (line[x] & ~closer);
+						best[x] = distance < best[x] ? distance : best[x];
+					}
+				}
+			}
+		}
+
+		// Add up the pixels of every center. The pixels of a row of cells
+		// only belong to centers of that row and the ones next to it, so
+		// every third row of cells can be added up at the same time.
+		memset(sums, 0, sums_size);
+
+		for (size_t phase = 0; phase < 3; phase++) {
+			#pragma omp parallel for schedule(dynamic)
+			for (size_t gy = phase; gy < rows; gy += 3) {
+				size_t start = (gy * height + rows - 1) / rows;
+				size_t end = ((gy + 1) * height + rows - 1) / rows;
+
+				for (size_t y = start; y < end; y++) {
+					const uint8_t* r = image_buffer_row(&planes, 0, y);
+					const uint8_t* g = image_buffer_row(&planes, 1, y);
+					const uint8_t* b = image_buffer_row(&planes, 2, y);
+
+					for (size_t x = 0; x < width; x++) {
+						SlicSum* sum = &sums[labels[y * width + x]];
+
+						sum->r += r[x];
+						sum->g += g[x];
+						sum->b += b[x];
+						sum->x += x;
+						sum->y += y;
+						sum->count++;
+					}
+				}
+			}
+		}
+
+		// Move every center to the mean of its pixels.
+		#pragma omp parallel for schedule(static)
+		for (size_t i = 0; i < cells; i++) {
+			const SlicSum* sum = &sums[i];
+
+			if (sum->count > 0) {
+				centers[i] = (SlicCenter) {
+					(float) sum->r / sum->count,
+					(float) sum->g / sum->count,
+					(float) sum->b / sum->count,
+					(float) sum->x / sum->count,
+					(float) sum->y / sum->count,
+				};
+			}
+		}
+	}
+
+	// Keep the largest superpixels, in the order of their cells.
+	if (ranks) {
+		for (size_t i = 0; i < cells; i++) {
+			ranks[i] = (SlicRank) { sums[i].count, i };
+		}
+
+		qsort(ranks, cells, sizeof(SlicRank), compare_slic_sizes);
+		qsort(ranks, count, sizeof(SlicRank), compare_slic_cells);
+	}
+
+	for (size_t i = 0; i < count; i++) {
+		const SlicCenter* center = &centers[ranks ? ranks[i].cell : i];
+
+		seed_list_push(seeds, (Point) {
+			fminf(roundf(center->x), width - 1),
+			fminf(roundf(center->y), height - 1)
+		});
+	}
+
+	image_buffer_free(&planes);
+	mem_free(mem, ranks, ranks_size);
+	mem_free(mem, distances, distances_size);
+	mem_free(mem, labels, labels_size);
+	mem_free(mem, sums, sums_size);
+	mem_free(mem, centers, centers_size);
+	return 1;
+}
+
+/**
+ * Order superpixels from the largest to the smallest,
+ * and those of the same size by their cells.
+ */
+static int compare_slic_sizes(const void* a, const void* b) {
+	const SlicRank* rank_a = a;
+	const SlicRank* rank_b = b;
+
+	if (rank_a->size != rank_b->size) {
+		return (rank_a->size < rank_b->size) - (rank_a->size > rank_b->size);
+	}
+
+	return (rank_a->cell > rank_b->cell) - (rank_a->cell < rank_b->cell);
+}
+
+static int compare_slic_cells(const void* a, const void* b) {
+	uint32_t cell_a = ((const SlicRank*) a)->cell;
+	uint32_t cell_b = ((const SlicRank*) b)->cell;
+	return (cell_a > cell_b) - (cell_a < cell_b);
+}
+
+/**
+ * Prepare an empty list of seeds that takes its memory from the given one.
+ */
+void seed_list_init(SeedList* list, Memory* mem) {
+	*list = (SeedList) { mem, NULL, 0, 0 };
+}
+
+void seed_list_free(SeedList* list) {
+	mem_free(list->mem, list->data, sizeof(Point) * list->capacity);
+	seed_list_init(list, list->mem);
+}
+
+/**
+ * Make room for at least the given number of seeds in the list,
+ * at least doubling its capacity whenever it has to grow.
+ *
+ * Returns 0 if it runs out of memory, leaving the list as it was.
+ */
+int seed_list_reserve(SeedList* list, size_t capacity) {
+	if (capacity <= list->capacity) {
+		return 1;
+	}
+
+	size_t grown = list->capacity ? list->capacity * 2 : 64;
+	capacity = capacity > grown ? capacity : grown;
+
+	Point* data = mem_alloc(list->mem, sizeof(Point) * capacity);
+
+	if (!data) {
+		return 0;
+	}
+
+	// An empty list has no buffer yet, which memcpy must not be given.
+	if (list->count > 0) {
+		memcpy(data, list->data, sizeof(Point) * list->count);
+	}
+
+	mem_free(list->mem, list->data, sizeof(Point) * list->capacity);
+
+	list->data = data;
+	list->capacity = capacity;
+	return 1;
+}
+
+/**
+ * Add a seed to the end of the given list, growing it if needed.
+ *
+ * Returns 0 if it runs out of memory.
+ */
+static int seed_list_push(SeedList* list, Point seed) {
+	if (!seed_list_reserve(list, list->count + 1)) {
+		return 0;
+	}
+
+	list->data[list->count++] = seed;
+	return 1;
+}
+
+/**
+ * Build a summed-area table of the given edges,
+ * where every entry holds the number of edges above and to the left of it.
+ *
+ * The table has one more row and column than the image,
+ * so that it starts with zeros.
+ *
+ * See also: https://en.wikipedia.org/wiki/Summed-area_table
+ *
+ * Returns NULL if it runs out of memory.
+ */
+uint32_t* build_edge_table(Memory* mem, ImageView edges) {
+	enum { strip = 1024 };
+	const size_t width = edges.width;
+	const size_t height = edges.height;
+	const size_t stride = width + 1;
+	uint32_t* table = mem_alloc(mem, sizeof(uint32_t) * stride * (height + 1));
+
+	if (!table) {
+		return NULL;
+	}
+
+	memset(table, 0, sizeof(uint32_t) * stride);
+
+	// Sum every row on its own...
+	#pragma omp parallel for schedule(static)
+	for (size_t row = 0; row < height; row++) {
+		uint32_t* line = table + (row + 1) * stride;
+		const Rgb* pixels = view_row(edges, row);
+		uint32_t sum = 0;
+		line[0] = 0;
+
+		for (size_t col = 0; col < width; col++) {
+			sum += pixels[col].r != BLACK.r;
+			line[col + 1] = sum;
+		}
+	}
+
+	// ...then add every row to the one below it.
+	const size_t strips = (stride + strip - 1) / strip;
+
+	#pragma omp parallel for schedule(static)
+	for (size_t s = 0; s < strips; s++) {
+		size_t start = s * strip;
+		size_t end = start + strip < stride ? start + strip : stride;
+
+		for (size_t row = 2; row <= height; row++) {
+			uint32_t* line = table + row * stride;
+			const uint32_t* above = line - stride;
+
+			for (size_t col = start; col < end; col++) {
+				line[col] += above[col];
+			}
+		}
+	}
+
+	return table;
+}
+
+/**
+ * Allocate memory for the current stage from the given source.
+ *
+ * Returns NULL if there isn't enough memory left.
+ */
+void* mem_alloc(Memory* mem, size_t size) {
+	void* ptr = mem->allocator.alloc(mem->allocator.ctx, size);
+
+	if (!ptr) {
+		return NULL;
+	}
+
+	lock(&mem->lock);
+	mem->in_use += size;
+	mem->allocated[mem->stage] += size;
+
+	if (mem->in_use > mem->peak[mem->stage]) {
+		mem->peak[mem->stage] = mem->in_use;
+	}
+
+	unlock(&mem->lock);
+	return ptr;
+}
+
+/**
+ * Give memory back to its source.
+ *
+ * The size must be the same one it was allocated with.
+ */
+void mem_free(Memory* mem, void* ptr, size_t size) {
+	if (!ptr) {
+		return;
+	}
+
+	mem->allocator.release(mem->allocator.ctx, ptr, size);
+
+	lock(&mem->lock);
+	mem->in_use -= size;
+	unlock(&mem->lock);
+}
+
+/**
+ * Attribute further allocations to the given stage.
+ */
+void mem_set_stage(Memory* mem, Stage stage) {
+	mem_end_stage(mem);
+	mem->stage = stage;
+	mem->peak[stage] = mem->in_use;
+	mem->started_faults = page_faults();
+	timespec_get(&mem->started, TIME_UTC);
+}
+
+/**
+ * Add the time and page faults since the current stage started to it.
+ */
+void mem_end_stage(Memory* mem) {
+	if (mem->started.tv_sec == 0) {
+		return;
+	}
+
+	struct timespec now;
+	timespec_get(&now, TIME_UTC);
+
+	mem->faults[mem->stage] += page_faults() - mem->started_faults;
+	mem->seconds[mem->stage] += (now.tv_sec - mem->started.tv_sec)
+		+ (now.tv_nsec - mem->started.tv_nsec) / 1e9;
+	mem->started.tv_sec = 0;
+}
+
+/**
+ * Take the given lock, spinning until whoever holds it lets go.
+ *
+ * Locks only guard a few counters and list heads at a time,
+ * so they are never held for long.
+ */
+static inline void lock(atomic_flag* flag) {
+	while (atomic_flag_test_and_set_explicit(flag, memory_order_acquire)) {
+	}
+}
+
+static inline void unlock(atomic_flag* flag) {
+	atomic_flag_clear_explicit(flag, memory_order_release);
+}
+
+/**
+ * Count the page faults the process has taken so far,
+ * or 0 where that is unknown.
+ */
+static long page_faults() {
+#ifdef HAVE_POSIX
+	struct rusage usage;
+
+	if (getrusage(RUSAGE_SELF, &usage) == 0) {
+		return usage.ru_minflt + usage.ru_majflt;
+	}
+#endif
+
+	return 0;
+}
+
+void print_memory(FILE* log, const Memory* mem) {
+	for (int i = 0; i < STAGE_COUNT; i++) {
+		fprintf(
+			log, "Memory      : %-7s peak %8.2f MB, allocated %8.2f MB, "
+			"%8ld faults, %8.2f ms\n",
+			stage_names[i],
+			mem->peak[i] / (1024.0 * 1024.0),
+			mem->allocated[i] / (1024.0 * 1024.0),
+			mem->faults[i], mem->seconds[i] * 1000
+		);
+	}
+}
+
+static void* system_alloc(void* ctx, size_t size) {
+	(void) ctx;
+
+#ifdef WIN32
+	return _aligned_malloc(size, image_align);
+#else
+	void* ptr;
+	return posix_memalign(&ptr, image_align, size) == 0 ? ptr : NULL;
+#endif
+}
+
+static void system_release(void* ctx, void* ptr, size_t size) {
+	(void) ctx;
+	(void) size;
+
+#ifdef WIN32
+	_aligned_free(ptr);
+#else
+	free(ptr);
+#endif
+}
+
+void pool_init(Pool* pool) {
+	memset(pool, 0, sizeof(*pool));
+	atomic_flag_clear(&pool->lock);
+}
+
+/**
+ * Give every block the pool holds back to the system.
+ */
+void pool_drain(Pool* pool) {
+	for (size_t c = 0; c < pool_classes; c++) {
+		while (pool->free[c]) {
+			void* block = pool->free[c];
+			pool->free[c] = *(void**) block;
+			system_release(NULL, block, pool_class_size(c));
+		}
+	}
+
+	pool->held = 0;
+}
+
+/**
+ * Map large allocations on their own, aligned to huge pages and with
+ * the kernel asked to back them with huge pages, and fault them in
+ * from all threads at once. Smaller ones come from the system allocator.
+ */
+static void* mmap_alloc(void* ctx, size_t size) {
+#ifdef HAVE_POSIX
+	if (size >= huge_page) {
+		size_t rounded = (size + huge_page - 1) & ~(huge_page - 1);
+		// Map an extra huge page so the block can start on a boundary,
+		// then give back what sticks out on either side.
+		uint8_t* base = mmap(
+			NULL, rounded + huge_page, PROT_READ | PROT_WRITE,
+			MAP_PRIVATE | MAP_ANONYMOUS, -1, 0
+		);
+
+		if (base == MAP_FAILED) {
+			return NULL;
+		}
+
+		uint8_t* ptr = (uint8_t*)
+			(((uintptr_t) base + huge_page - 1) & ~(uintptr_t) (huge_page - 1));
+
+		if (ptr > base) {
+			munmap(base, ptr - base);
+		}
+
+		munmap(ptr + rounded, base + huge_page - ptr);
+
+#ifdef MADV_HUGEPAGE
+		madvise(ptr, rounded, MADV_HUGEPAGE);
+#endif
+
+		#pragma omp parallel for schedule(static)
+		for (size_t offset = 0; offset < rounded; offset += small_page) {
+			ptr[offset] = 0;
+		}
+
+		return ptr;
+	}
+#endif
+
+	return system_alloc(ctx, size);
+}
+
+static void mmap_release(void* ctx, void* ptr, size_t size) {
+#ifdef HAVE_POSIX
+	if (size >= huge_page) {
+		munmap(ptr, (size + huge_page - 1) & ~(huge_page - 1));
+		return;
+	}
+#endif
+
+	system_release(ctx, ptr, size);
+}
+
+void print_pool(FILE* log, const Pool* pool) {
+	fprintf(
+		log, "Pool        : %zu reused, %zu allocated, %8.2f MB held\n",
+		pool->hits, pool->misses, pool->held / (1024.0 * 1024.0)
+	);
+}
+
+/**
+ * Find the size class of an allocation.
+ *
+ * There are four classes between consecutive powers of two starting at 64
+ * bytes, so a block is never more than a quarter larger than requested.
+ */
+static size_t pool_class(size_t size) {
+	if (size <= 64) {
+		return 0;
+	}
+
+	size_t n = size - 1;
+	int top = 63 - __builtin_clzll(n);
+
+	return 4 * (top - 6) + ((n >> (top - 2)) & 3) + 1;
+}
+
+static size_t pool_class_size(size_t c) {
+	return (4 + c % 4) << (c / 4 + 4);
+}
+
+/**
+ * Reuse a released block of the same size class, or get a new one
+ * from the system.
+ */
+static void* pool_alloc(void* ctx, size_t size) {
+	Pool* pool = ctx;
+	size_t c = pool_class(size);
+	void* block;
+
+	lock(&pool->lock);
+	block = pool->free[c];
+
+	if (block) {
+		pool->free[c] = *(void**) block;
+		pool->held -= pool_class_size(c);
+		pool->hits++;
+	} else {
+		pool->misses++;
+	}
+
+	unlock(&pool->lock);
+
+	return block ? block : system_alloc(NULL, pool_class_size(c));
+}
+
+/**
+ * Keep a block for later allocations of the same size class,
+ * linking it into the free list through its first bytes.
+ */
+static void pool_release(void* ctx, void* ptr, size_t size) {
+	Pool* pool = ctx;
+	size_t c = pool_class(size);
+
+	lock(&pool->lock);
+	*(void**) ptr = pool->free[c];
+	pool->free[c] = ptr;
+	pool->held += pool_class_size(c);
+	unlock(&pool->lock);
+}
+
+/**
+ * Build a summed-area table of the given image, where every entry
+ * holds the sums of the red, green and blue values above and to the
+ * left of it, followed by the sums of their squares.
+ *
+ * Like build_edge_table(), it has one more row and column than the image,
+ * and is NULL if there isn't enough memory left for it.
+ */
+uint64_t* build_color_table(Memory* mem, ImageView in) {
+	enum { strip = 1024 };
+	const size_t width = in.width;
+	const size_t height = in.height;
+	const size_t stride = 6 * (width + 1);
+	uint64_t* table = mem_alloc(mem, sizeof(uint64_t) * stride * (height + 1));
+
+	if (!table) {
+		return NULL;
+	}
+
+	memset(table, 0, sizeof(uint64_t) * stride);
+
+	// Sum every row on its own...
+	#pragma omp parallel for schedule(static)
+	for (size_t row = 0; row < height; row++) {
+		uint64_t* line = table + (row + 1) * stride;
+		const Rgb* pixels = view_row(in, row);
+		uint64_t sums[6] = { 0 };
+
+		memset(line, 0, sizeof(uint64_t) * 6);
+
+		for (size_t col = 0; col < width; col++) {
+			Rgb p = pixels[col];
+			uint64_t* entry = line + 6 * (col + 1);
+
+			sums[0] += p.r;
+			sums[1] += p.g;
+			sums[2] += p.b;
+			sums[3] += p.r * p.r;
+			sums[4] += p.g * p.g;
+			sums[5] += p.b * p.b;
+			memcpy(entry, sums, sizeof(sums));
+		}
+	}
+
+	// ...then add every row to the one below it.
+	const size_t strips = (stride + strip - 1) / strip;
+
+	#pragma omp parallel for schedule(static)
+	for (size_t s = 0; s < strips; s++) {
+		size_t start = s * strip;
+		size_t end = start + strip < stride ? start + strip : stride;
+
+		for (size_t row = 2; row <= height; row++) {
+			uint64_t* line = table + row * stride;
+			const uint64_t* above = line - stride;
+
+			for (size_t col = start; col < end; col++) {
+				line[col] += above[col];
+			}
+		}
+	}
+
+	return table;
+}
+
+/**
+ * View a whole image whose rows follow each other in memory.
+ */
+ImageView image_view(Rgb* data, size_t width, size_t height) {
+	return (ImageView) { data, width, height, width };
+}
+
+/**
+ * View a region of another view without copying its pixels.
+ *
+ * The region must lie within the view.
+ */
+ImageView crop_view(
+	ImageView view, size_t x, size_t y, size_t width, size_t height
+) {
+	return (ImageView) { view_row(view, y) + x, width, height, view.stride };
+}
+
+/**
+ * Allocate pixels for an image and view all of them.
+ *
+ * The view has no pixels if there isn't enough memory left.
+ */
+ImageView alloc_view(Memory* mem, size_t width, size_t height) {
+	Rgb* data = mem_alloc(mem, sizeof(Rgb) * width * height);
+	return image_view(data, width, height);
+}
+
+/**
+ * Free the pixels of a view made by alloc_view().
+ */
+void free_view(Memory* mem, ImageView view) {
+	mem_free(mem, view.data, sizeof(Rgb) * view.stride * view.height);
+}
+
+/**
+ * Allocate an image buffer with the given layout, whose rows all start
+ * on a 64 byte boundary.
+ *
+ * Returns 0 if it runs out of memory, leaving the buffer without pixels.
+ */
+int image_buffer_init(
+	Memory* mem, ImageBuffer* image,
+	size_t width, size_t height, Layout layout
+) {
+	size_t row_size = layout == LAYOUT_PLANAR ? width : 4 * width;
+
+	*image = (ImageBuffer) { mem, width, height, 0, layout, 0, NULL, 0 };
+	image->stride = (row_size + image_align - 1) & ~(image_align - 1);
+	image->planes = layout == LAYOUT_PLANAR ? 3 : 1;
+	image->size = image->stride * height * image->planes;
+	image->data = mem_alloc(mem, image->size);
+	return image->data != NULL;
+}
+
+void image_buffer_free(ImageBuffer* image) {
+	mem_free(image->mem, image->data, image->size);
+	image->data = NULL;
+}
+
+/**
+ * Copy packed pixels, like the ones SOIL loads, into an image buffer.
+ *
+ * Padding bytes, and the X channel of RGBX pixels, are set to zero.
+ */
+void image_buffer_from_rgb(ImageBuffer* image, ImageView in) {
+	const size_t width = image->width;
+
+	#pragma omp parallel for schedule(static)
+	for (size_t row = 0; row < image->height; row++) {
+		const Rgb* line = view_row(in, row);
+
+		if (image->layout == LAYOUT_PLANAR) {
+			uint8_t* r = image_buffer_row(image, 0, row);
+			uint8_t* g = image_buffer_row(image, 1, row);
+			uint8_t* b = image_buffer_row(image, 2, row);
+
+			for (size_t col = 0; col < width; col++) {
+				r[col] = line[col].r;
+				g[col] = line[col].g;
+				b[col] = line[col].b;
+			}
+
+			for (size_t col = width; col < image->stride; col++) {
+				r[col] = g[col] = b[col] = 0;
+			}
+		} else {
+			uint32_t* dst = (uint32_t*) image_buffer_row(image, 0, row);
+
+			// Build every pixel as a word so the stores are full width.
+			for (size_t col = 0; col < width; col++) {
+				Rgb p = line[col];
+				dst[col] = p.r | p.g << 8 | (uint32_t) p.b << 16;
+			}
+
+			memset(dst + width, 0, image->stride - 4 * width);
+		}
+	}
+}
+
+/**
+ * Copy the pixels of an image buffer back into packed pixels,
+ * like the ones SOIL creates textures and saves images from.
+ */
+void image_buffer_to_rgb(const ImageBuffer* image, ImageView out) {
+	const size_t width = image->width;
+
+	#pragma omp parallel for schedule(static)
+	for (size_t row = 0; row < image->height; row++) {
+		Rgb* line = view_row(out, row);
+
+		if (image->layout == LAYOUT_PLANAR) {
+			const uint8_t* r = image_buffer_row(image, 0, row);
+			const uint8_t* g = image_buffer_row(image, 1, row);
+			const uint8_t* b = image_buffer_row(image, 2, row);
+
+			for (size_t col = 0; col < width; col++) {
+				line[col] = (Rgb) { r[col], g[col], b[col] };
+			}
+		} else {
+			const uint32_t* src =
+				(const uint32_t*) image_buffer_row(image, 0, row);
+
+			for (size_t col = 0; col < width; col++) {
+				uint32_t p = src[col];
+				line[col] = (Rgb) { p, p >> 8, p >> 16 };
+			}
+		}
+	}
+}
+
+/**
+ * Approximate a gaussian blur of the given radius by
+ * running several passes of a box blur over the image.
+ *
+ * Every box blur keeps a running sum over a sliding window,
+ * so its cost per pixel does not depend on the radius.
+ *
+ * See also: https://en.wikipedia.org/wiki/Box_blur
+ *
+ * Returns 0 if it runs out of memory.
+ */
+int blur(Memory* mem, ImageView in, ImageView out, int radius) {
+	ImageView tmp = alloc_view(mem, in.width, in.height);
+	ImageView src = in;
+
+	if (!tmp.data) {
+		return 0;
+	}
+
+	// A wider window only adds more copies of the border pixels,
+	// so keep the cost of filling it bounded by the image.
+	// The radius has been checked to be positive by then.
+	size_t reach = in.width > in.height ? in.width : in.height;
+	size_t window_radius = radius;
+	if (window_radius > reach) {
+		window_radius = reach;
+	}
+
+	for (int pass = 0; pass < blur_passes; pass++) {
+		box_blur_rows(src, tmp, window_radius);
+		box_blur_cols(tmp, out, window_radius);
+		src = out;
+	}
+
+	free_view(mem, tmp);
+	return 1;
+}
+
+/**
+ * Average every pixel with its horizontal neighbors within the radius.
+ *
+ * Pixels outside of the image are clamped to the nearest border.
+ */
+static void box_blur_rows(ImageView in, ImageView out, size_t radius) {
+	const uint32_t window = 2*radius + 1;
+	const size_t width = in.width;
+	const size_t last = width - 1;
+
+	#pragma omp parallel for schedule(static)
+	for (size_t row = 0; row < in.height; row++) {
+		const Rgb* line = view_row(in, row);
+		Rgb* dst = view_row(out, row);
+		uint32_t r = line[0].r * (radius + 1);
+		uint32_t g = line[0].g * (radius + 1);
+		uint32_t b = line[0].b * (radius + 1);
+
+		for (size_t i = 1; i <= radius; i++) {
+			Rgb p = line[i < last ? i : last];
+			r += p.r;
+			g += p.g;
+			b += p.b;
+		}
+
+		for (size_t col = 0; col < width; col++) {
+			dst[col] = (Rgb) {
+				(r + radius) / window,
+				(g + radius) / window,
+				(b + radius) / window,
+			};
+
+			// Slide the window one pixel to the right.
+			size_t add = col + radius + 1;
+			Rgb enter = line[add < last ? add : last];
+			Rgb leave = line[col > radius ? col - radius : 0];
+			r += enter.r - leave.r;
+			g += enter.g - leave.g;
+			b += enter.b - leave.b;
+		}
+	}
+}
+
+/**
+ * Average every pixel with its vertical neighbors within the radius.
+ *
+ * Instead of walking down each column, every thread sweeps a strip
+ * of the image row by row, keeping one running sum per channel.
+ * That way memory is read sequentially and the inner loops
+ * can be vectorized.
+ */
+static void box_blur_cols(ImageView in, ImageView out, size_t radius) {
+	enum { strip = 256 };
+	const uint32_t window = 2*radius + 1;
+	const size_t height = in.height;
+	const size_t last = height - 1;
+	const size_t row_size = in.width * sizeof(Rgb);
+	const size_t strips = (row_size + strip - 1) / strip;
+
+	#pragma omp parallel for schedule(static)
+	for (size_t s = 0; s < strips; s++) {
+		size_t start = s * strip;
+		size_t len = row_size - start < strip ? row_size - start : strip;
+		uint32_t sums[strip];
+
+		const unsigned char* first = (unsigned char*) view_row(in, 0) + start;
+
+		for (size_t i = 0; i < len; i++) {
+			sums[i] = first[i] * (radius + 1);
+		}
+
+		for (size_t j = 1; j <= radius; j++) {
+			const unsigned char* line =
+				(unsigned char*) view_row(in, j < last ? j : last) + start;
+
+			for (size_t i = 0; i < len; i++) {
+				sums[i] += line[i];
+			}
+		}
+
+		for (size_t row = 0; row < height; row++) {
+			unsigned char* dst = (unsigned char*) view_row(out, row) + start;
+			size_t add = row + radius + 1;
+			size_t sub = row > radius ? row - radius : 0;
+			const unsigned char* enter =
+				(unsigned char*) view_row(in, add < last ? add : last) + start;
+			const unsigned char* leave =
+				(unsigned char*) view_row(in, sub) + start;
+
+			for (size_t i = 0; i < len; i++) {
+				dst[i] = (sums[i] + radius) / window;
+				sums[i] += enter[i] - leave[i];
+			}
+		}
+	}
+}
+
+/*
+ * Generate the gradient of a 3x3 operator made of the smoothing taps
+ * (a, b, a) and the derivative taps (-1, 0, +1).
+ *
+ * The zero taps are never read and symmetric taps are added
+ * together before being multiplied by their shared coefficient.
+ */
+#define GRADIENT_3X3(name, a, b) \
+static inline void name(const uint16_t* p, size_t w, int* gx, int* gy) { \
+	const uint16_t* up = p - w; \
+	const uint16_t* down = p + w; \
+	*gx = (a) * ((up[1] - up[-1]) + (down[1] - down[-1])) \
+		+ (b) * (p[1] - p[-1]); \
+	*gy = (a) * ((up[-1] - down[-1]) + (up[1] - down[1])) \
+		+ (b) * (up[0] - down[0]); \
+}
+
+/*
+ * Generate the gradient of a 5x5 operator made of the smoothing taps
+ * (a, b, c, b, a) and the derivative taps (-e, -d, 0, +d, +e).
+ */
+#define GRADIENT_5X5(name, a, b, c, d, e) \
+static inline void name(const uint16_t* p, size_t w, int* gx, int* gy) { \
+	const uint16_t* r[] = { p - 2*w, p - w, p, p + w, p + 2*w }; \
+	int dx[5], dy[5]; \
+	for (int i = 0; i < 5; i++) { \
+		dx[i] = (d) * (r[i][1] - r[i][-1]) + (e) * (r[i][2] - r[i][-2]); \
+		dy[i] = (d) * (r[1][i-2] - r[3][i-2]) \
+			+ (e) * (r[0][i-2] - r[4][i-2]); \
+	} \
+	*gx = (a) * (dx[0] + dx[4]) + (b) * (dx[1] + dx[3]) + (c) * dx[2]; \
+	*gy = (a) * (dy[0] + dy[4]) + (b) * (dy[1] + dy[3]) + (c) * dy[2]; \
+}
+
+/*
+ * Generate a function that applies the given gradient to every pixel
+ * at least radius pixels away from the borders and thresholds
+ * its squared magnitude against the given limit.
+ *
+ * The squared magnitudes are also kept if an array is given for them.
+ */
+#define EDGE_DETECTOR(name, gradient, radius) \
+static void name( \
+	const uint16_t* in, ImageView out, \
+	uint32_t* magnitudes, int64_t limit \
+) { \
+	const size_t width = out.width; \
+	const size_t height = out.height; \
+	_Pragma("omp parallel for schedule(static)") \
+	for (size_t row = radius; row < height - radius; row++) { \
+		const uint16_t* line = in + row*width; \
+		Rgb* dst = view_row(out, row); \
+		for (size_t col = radius; col < width - radius; col++) { \
+			int gx, gy; \
+			gradient(line + col, width, &gx, &gy); \
+			int64_t g = (int64_t) gx*gx + (int64_t) gy*gy; \
+			dst[col] = g < limit ? BLACK : WHITE; \
+			if (magnitudes) { \
+				magnitudes[row*width + col] = g; \
+			} \
+		} \
+	} \
+}
+
+GRADIENT_3X3(sobel_gradient, 1, 2)
+GRADIENT_3X3(scharr_gradient, 3, 10)
+GRADIENT_3X3(prewitt_gradient, 1, 1)
+GRADIENT_5X5(sobel_5x5_gradient, 1, 4, 6, 2, 1)
+
+EDGE_DETECTOR(detect_sobel_edges, sobel_gradient, 1)
+EDGE_DETECTOR(detect_scharr_edges, scharr_gradient, 1)
+EDGE_DETECTOR(detect_prewitt_edges, prewitt_gradient, 1)
+EDGE_DETECTOR(detect_sobel_5x5_edges, sobel_5x5_gradient, 2)
+
+/**
+ * Find the edge operator with the given name.
+ *
+ * Returns -1 if there is none.
+ */
+int find_edge_operator(const char* name) {
+	for (int i = 0; i < OPERATOR_COUNT; i++) {
+		if (strcmp(edge_operators[i].name, name) == 0) {
+			return i;
+		}
+	}
+
+	return -1;
+}
+
+/**
+ * Perform edge detection on the given image
+ * using the given gradient operator.
+ *
+ * Unlike a standard implementation, this function transforms
+ * gradient edge values into binary ones.
+ *
+ * This is done to simplify further processing and is based
+ * on the given threshold.
+ *
+ * The kernels of every operator are compile time constants.
+ * Gradients are computed over the sum of the color channels,
+ * which is the same as convolving each channel and adding the results.
+ *
+ * See also: https://en.wikipedia.org/wiki/Sobel_operator
+ *
+ * args:
+ * threshold: the higher it is, the less edges will be found.
+ *			  should be a number between 0 and 4327.
+ *			  it is scaled by the gain of the operator,
+ *			  so it means the same for all of them.
+ * magnitudes: where to keep the squared gradient magnitudes
+ *			   before they are thresholded, or NULL.
+ *
+ * Returns 0 if it runs out of memory.
+ */
+int detect_edges(
+	Memory* mem, ImageView in, ImageView out,
+	uint32_t* magnitudes, int threshold, EdgeOperator op
+) {
+	const size_t width = in.width;
+	const size_t height = in.height;
+	const size_t radius = edge_operators[op].radius;
+	const size_t sums_size = sizeof(uint16_t) * width * height;
+	uint16_t* sums = mem_alloc(mem, sums_size);
+
+	if (!sums) {
+		return 0;
+	}
+
+	#pragma omp parallel for schedule(static)
+	for (size_t row = 0; row < height; row++) {
+		const Rgb* line = view_row(in, row);
+
+		for (size_t col = 0; col < width; col++) {
+			Rgb p = line[col];
+			sums[row*width + col] = p.r + p.g + p.b;
+		}
+	}
+
+	// The operators can't be applied to pixels close to the borders.
+	for (size_t row = 0; row < height; row++) {
+		for (size_t col = 0; col < width; col++) {
+			if (row < radius || row + radius >= height
+					|| col < radius || col + radius >= width) {
+				view_row(out, row)[col] = BLACK;
+
+				if (magnitudes) {
+					magnitudes[row*width + col] = 0;
+				}
+			}
+		}
+	}
+
+	if (width <= 2*radius || height <= 2*radius) {
+		mem_free(mem, sums, sums_size);
+		return 1;
+	}
+
+	int64_t limit = edge_limit(threshold, op);
+
+	switch (op) {
+	case OPERATOR_SOBEL:
+		detect_sobel_edges(sums, out, magnitudes, limit);
+		break;
+	case OPERATOR_SOBEL_5X5:
+		detect_sobel_5x5_edges(sums, out, magnitudes, limit);
+		break;
+	case OPERATOR_SCHARR:
+		detect_scharr_edges(sums, out, magnitudes, limit);
+		break;
+	case OPERATOR_PREWITT:
+		detect_prewitt_edges(sums, out, magnitudes, limit);
+		break;
+	default:
+		break;
+	}
+
+	mem_free(mem, sums, sums_size);
+	return 1;
+}
+
+/**
+ * Get the squared gradient magnitude of the given operator
+ * that the given threshold stands for.
+ *
+ * Magnitudes are compared squared and scaled to the gain of the sobel
+ * operator, which avoids a square root per pixel.
+ */
+static int64_t edge_limit(int threshold, EdgeOperator op) {
+	if (threshold <= 0) {
+		return 0;
+	}
+
+	int64_t scaled = (int64_t) threshold * edge_operators[op].gain;
+	int64_t sobel_gain = edge_operators[OPERATOR_SOBEL].gain;
+	return (scaled*scaled + sobel_gain*sobel_gain - 1)
+		/ (sobel_gain*sobel_gain);
+}
+
+/**
+ * Shrink the given image to half its size,
+ * averaging every 2x2 block of pixels into one.
+ *
+ * Odd sizes are rounded up, and the last row or column
+ * is averaged with itself.
+ */
+void downsample(ImageView in, ImageView out) {
+	#pragma omp parallel for schedule(static)
+	for (size_t row = 0; row < out.height; row++) {
+		size_t y0 = 2*row;
+		size_t y1 = y0 + 1 < in.height ? y0 + 1 : y0;
+		const Rgb* top = view_row(in, y0);
+		const Rgb* bottom = view_row(in, y1);
+		Rgb* dst = view_row(out, row);
+
+		for (size_t col = 0; col < out.width; col++) {
+			size_t x0 = 2*col;
+			size_t x1 = x0 + 1 < in.width ? x0 + 1 : x0;
+			Rgb a = top[x0], b = top[x1];
+			Rgb c = bottom[x0], d = bottom[x1];
+
+			dst[col] = (Rgb) {
+				(a.r + b.r + c.r + d.r + 2) / 4,
+				(a.g + b.g + c.g + d.g + 2) / 4,
+				(a.b + b.b + c.b + d.b + 2) / 4,
+			};
+		}
+	}
+}
+
+/**
+ * Perform edge detection on a pyramid of the given image,
+ * where every level is half the size of the previous one.
+ *
+ * Averaging 2x2 blocks keeps the contrast of a step between two regions,
+ * so every level is thresholded the same way. Fine texture and noise
+ * average out on the coarser levels while the outlines of large regions
+ * stay, which makes the edges found depend less on the resolution.
+ *
+ * An edge found at full resolution is kept if any coarser level
+ * has an edge around the pixel that covers it, or if its gradient
+ * is at least twice the threshold. Coarse structure thereby decides
+ * where the image is subdivided into large cells, weak fine edges only
+ * place small cells within it, and strong fine detail that vanishes
+ * once the image is shrunk is not lost.
+ *
+ * args:
+ * magnitudes: where to keep the squared gradient magnitudes
+ *			   of the full image, or NULL.
+ * levels: how many levels the pyramid has, including the full image.
+ *
+ * Returns 0 if it runs out of memory.
+ */
+int detect_edges_pyramid(
+	Memory* mem, ImageView in, ImageView out,
+	uint32_t* magnitudes, int threshold, EdgeOperator op, int levels
+) {
+	ImageView images[levels];
+	ImageView edges[levels];
+	const size_t width = in.width;
+	const size_t height = in.height;
+	const size_t strengths_size = sizeof(uint32_t) * width * height;
+	const int64_t strong = edge_limit(2 * threshold, op);
+	uint32_t* strengths = magnitudes
+		? magnitudes
+		: mem_alloc(mem, strengths_size);
+
+	int ok = strengths != NULL;
+
+	images[0] = in;
+	edges[0] = out;
+
+	for (int i = 1; i < levels; i++) {
+		images[i] = (ImageView) { NULL };
+		edges[i] = (ImageView) { NULL };
+	}
+
+	for (int i = 1; i < levels && ok; i++) {
+		size_t level_width = (images[i-1].width + 1) / 2;
+		size_t level_height = (images[i-1].height + 1) / 2;
+		images[i] = alloc_view(mem, level_width, level_height);
+		edges[i] = alloc_view(mem, level_width, level_height);
+		ok = images[i].data && edges[i].data;
+
+		if (ok) {
+			downsample(images[i-1], images[i]);
+		}
+	}
+
+	for (int i = 0; i < levels && ok; i++) {
+		ok = detect_edges(
+			mem, images[i], edges[i], i == 0 ? strengths : NULL,
+			threshold, op
+		);
+	}
+
+	if (ok) {
+		#pragma omp parallel for schedule(static)
+		for (size_t row = 0; row < height; row++) {
+			Rgb* line = view_row(out, row);
+
+			for (size_t col = 0; col < width; col++) {
+				if (line[col].r == BLACK.r
+						|| strengths[row*width + col] >= strong) {
+					continue;
+				}
+
+				int supported = 0;
+
+				for (int i = 1; i < levels && !supported; i++) {
+					ImageView coarse = edges[i];
+					size_t px = col >> i, py = row >> i;
+					size_t left = px > 0 ? px - 1 : 0;
+					size_t right = px + 1 < coarse.width ? px + 1 : px;
+					size_t top = py > 0 ? py - 1 : 0;
+					size_t bottom = py + 1 < coarse.height ? py + 1 : py;
+
+					for (size_t y = top; y <= bottom && !supported; y++) {
+						for (size_t x = left; x <= right; x++) {
+							if (view_row(coarse, y)[x].r != BLACK.r) {
+								supported = 1;
+								break;
+							}
+						}
+					}
+				}
+
+				if (!supported) {
+					line[col] = BLACK;
+				}
+			}
+		}
+	}
+
+	for (int i = levels - 1; i > 0; i--) {
+		free_view(mem, edges[i]);
+		free_view(mem, images[i]);
+	}
+
+	if (strengths != magnitudes) {
+		mem_free(mem, strengths, strengths_size);
+	}
+
+	return ok;
+}
+
+/**
+ * Find the morphological operation with the given name.
+ *
+ * Returns -1 if there is none.
+ */
+int find_morphology(const char* name) {
+	for (int i = 0; i < MORPH_COUNT; i++) {
+		if (strcmp(morph_names[i], name) == 0) {
+			return i;
+		}
+	}
+
+	return -1;
+}
+
+/**
+ * Apply a morphological operation to the edge map, using a square
+ * of the given radius as structuring element.
+ *
+ * The edges are packed into a bitmap first, so that every operation
+ * handles 64 pixels at once with shifts and bitwise operators.
+ * Pixels outside of the image never grow edges and never erode them.
+ *
+ * Returns 0 if it runs out of memory.
+ */
+int morph_edges(Memory* mem, ImageView edges, Morphology op, int radius) {
+	if (op == MORPH_NONE || radius <= 0) {
+		return 1;
+	}
+
+	const size_t width = edges.width;
+	const size_t height = edges.height;
+
+	// Every row and column is all set or all clear
+	// once the radius spans the image.
+	size_t reach = width > height ? width : height;
+	size_t window_radius = radius;
+	if (window_radius > reach) {
+		window_radius = reach;
+	}
+	const size_t words = (width + 63) / 64;
+	const size_t bitmap_size = sizeof(uint64_t) * words * height;
+	uint64_t* bits = mem_alloc(mem, bitmap_size);
+	uint64_t* scratch = mem_alloc(mem, bitmap_size);
+
+	if (!bits || !scratch) {
+		mem_free(mem, scratch, bitmap_size);
+		mem_free(mem, bits, bitmap_size);
+		return 0;
+	}
+
+	#pragma omp parallel for schedule(static)
+	for (size_t y = 0; y < height; y++) {
+		uint64_t* row = bits + y * words;
+		const Rgb* line = view_row(edges, y);
+		memset(row, 0, sizeof(uint64_t) * words);
+
+		for (size_t x = 0; x < width; x++) {
+			row[x / 64] |= (uint64_t) (line[x].r != 0) << (x % 64);
+		}
+	}
+
+	switch (op) {
+	case MORPH_DILATE:
+		morph_pass(width, height, bits, scratch, window_radius, 0);
+		break;
+	case MORPH_ERODE:
+		morph_pass(width, height, bits, scratch, window_radius, 1);
+		break;
+	case MORPH_OPEN:
+		morph_pass(width, height, bits, scratch, window_radius, 1);
+		morph_pass(width, height, bits, scratch, window_radius, 0);
+		break;
+	case MORPH_CLOSE:
+		morph_pass(width, height, bits, scratch, window_radius, 0);
+		morph_pass(width, height, bits, scratch, window_radius, 1);
+		break;
+	default:
+		break;
+	}
+
+	#pragma omp parallel for schedule(static)
+	for (size_t y = 0; y < height; y++) {
+		const uint64_t* row = bits + y * words;
+		Rgb* line = view_row(edges, y);
+
+		for (size_t x = 0; x < width; x++) {
+			line[x] = row[x / 64] >> (x % 64) & 1 ? WHITE : BLACK;
+		}
+	}
+
+	mem_free(mem, scratch, bitmap_size);
+	mem_free(mem, bits, bitmap_size);
+	return 1;
+}
+
+/**
+ * Dilate or erode the given bitmap in place by a square of the given
+ * radius, first along its rows and then along its columns.
+ *
+ * A window of 2r + 1 pixels is covered by a window of r + 1 pixels
+ * reaching forwards followed by one reaching backwards. Each of them
+ * combines every pixel with the one at a doubling distance from it,
+ * so a pass takes about 2 log r steps whatever the radius.
+ */
+static void morph_pass(
+	size_t width, size_t height, uint64_t* bits, uint64_t* scratch,
+	size_t radius, int erode
+) {
+	const size_t words = (width + 63) / 64;
+	const uint64_t fill = erode ? ~(uint64_t) 0 : 0;
+	uint64_t* src = bits;
+	uint64_t* dst = scratch;
+
+	#pragma omp parallel for schedule(static)
+	for (size_t y = 0; y < height; y++) {
+		morph_row(width, bits + y * words, radius, erode);
+	}
+
+	// Rows outside of the image are left out, which is the same
+	// as treating them as all set when eroding and all clear when dilating.
+	// Every step reads whole rows of the previous one, so the steps go
+	// back and forth between the bitmap and the scratch space.
+	for (int back = 0; back < 2; back++) {
+		for (size_t covered = 1; covered <= radius;) {
+			size_t rest = radius + 1 - covered;
+			size_t distance = covered < rest ? covered : rest;
+
+			#pragma omp parallel for schedule(static)
+			for (size_t y = 0; y < height; y++) {
+				const uint64_t* row = src + y * words;
+				const uint64_t* other = NULL;
+				uint64_t* out = dst + y * words;
+
+				if (back && y >= distance) {
+					other = src + (y - distance) * words;
+				} else if (!back && y + distance < height) {
+					other = src + (y + distance) * words;
+				}
+
+				for (size_t i = 0; i < words; i++) {
+					uint64_t word = other ? other[i] : fill;
+					out[i] = erode ? row[i] & word : row[i] | word;
+				}
+			}
+
+			uint64_t* swap = src;
+			src = dst;
+			dst = swap;
+			covered += distance;
+		}
+	}
+
+	if (src != bits) {
+		memcpy(bits, src, sizeof(uint64_t) * words * height);
+	}
+}
+
+/**
+ * Dilate or erode one row of a bitmap in place by the given radius,
+ * the same way morph_pass() does with its columns.
+ */
+static void morph_row(size_t width, uint64_t* row, size_t radius, int erode) {
+	const size_t words = (width + 63) / 64;
+	const uint64_t fill = erode ? ~(uint64_t) 0 : 0;
+	// Bits of the last word past the end of the row.
+	const uint64_t pad = width % 64 ? ~(uint64_t) 0 << width % 64 : 0;
+
+	row[words - 1] |= fill & pad;
+
+	for (int back = 0; back < 2; back++) {
+		for (size_t covered = 1; covered <= radius;) {
+			size_t rest = radius + 1 - covered;
+			size_t distance = covered < rest ? covered : rest;
+
+			morph_shift(row, words, distance, back, fill, erode);
+			covered += distance;
+		}
+	}
+
+	row[words - 1] &= ~pad;
+}
+
+/**
+ * Combine every pixel of a row of a bitmap, in place, with the pixel
+ * the given distance after it, or before it when going back.
+ * Pixels past either end of the row are taken to be the fill.
+ *
+ * Going forwards only reads words that haven't been written yet when
+ * walking up the row, and going back when walking down it.
+ */
+static void morph_shift(
+	uint64_t* row, size_t words, size_t distance, int back,
+	uint64_t fill, int erode
+) {
+	const size_t skip = distance / 64;
+	const unsigned bit = distance % 64;
+
+	for (size_t n = 0; n < words; n++) {
+		size_t i = back ? words - 1 - n : n;
+		uint64_t near, far, moved;
+
+		if (back) {
+			near = i >= skip ? row[i - skip] : fill;
+			far = i >= skip + 1 ? row[i - skip - 1] : fill;
+			moved = bit ? near << bit | far >> (64 - bit) : near;
+		} else {
+			near = i + skip < words ? row[i + skip] : fill;
+			far = i + skip + 1 < words ? row[i + skip + 1] : fill;
+			moved = bit ? near >> bit | far << (64 - bit) : near;
+		}
+
+		row[i] = erode ? row[i] & moved : row[i] | moved;
+	}
+}
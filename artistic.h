@@ -0,0 +1,292 @@
+/* artistic.h */
+#ifndef ARTISTIC_H
+#define ARTISTIC_H
+
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <time.h>
+
+typedef struct {
+    unsigned char r, g, b;
+} Rgb;
+
+typedef struct point {
+	size_t x;
+	size_t y;
+} Point;
+
+// Pixels of an image, or of a region of one, that belong to someone else.
+// Crops and tiles share the pixels of the image they come from.
+typedef struct {
+	Rgb* data;
+	size_t width, height;
+	// Pixels from the start of a row to the start of the next one.
+	size_t stride;
+} ImageView;
+
+// How the channels of an image buffer are laid out in memory.
+typedef enum {
+	// One 32 bit word per pixel holding red, green, blue and a zero byte.
+	LAYOUT_RGBX,
+	// A separate plane of bytes for each of red, green and blue.
+	LAYOUT_PLANAR
+} Layout;
+
+// Steps of the processing pipeline, in the order they run.
+typedef enum {
+	STAGE_BLUR,
+	STAGE_EDGES,
+	STAGE_SEEDS,
+	STAGE_STYLIZE,
+	STAGE_COUNT
+} Stage;
+
+// Source of the memory used by the processing stages.
+// Every allocation must be aligned to 64 bytes.
+typedef struct {
+	void* (*alloc)(void* ctx, size_t size);
+	void (*release)(void* ctx, void* ptr, size_t size);
+	void* ctx;
+} Allocator;
+
+// Number of size classes of a pool, enough for any 64 bit size.
+enum { pool_classes = 4 * 58 };
+
+// Keeps the blocks released by the stages in free lists by size class,
+// so the next allocations of the same size reuse them.
+typedef struct {
+	// Taken while the free lists change, as the buffers a run hands on
+	// can come back to the pool from another thread.
+	atomic_flag lock;
+	void* free[pool_classes];
+	// Bytes sitting in the free lists.
+	size_t held;
+	// Allocations served from the free lists or by the system.
+	size_t hits, misses;
+} Pool;
+
+// Sources of memory that can be picked from the command line.
+typedef enum {
+	ALLOC_MALLOC,
+	ALLOC_POOL,
+	ALLOC_MMAP,
+	ALLOC_COUNT
+} AllocatorKind;
+
+// Keeps track of how much memory every stage uses.
+typedef struct {
+	Allocator allocator;
+	// Taken while the counters below change.
+	atomic_flag lock;
+	Stage stage;
+	size_t in_use;
+	// Most bytes in use at once while each stage ran.
+	size_t peak[STAGE_COUNT];
+	// Total bytes allocated by each stage.
+	size_t allocated[STAGE_COUNT];
+	// Page faults taken and seconds spent in each stage.
+	long faults[STAGE_COUNT];
+	double seconds[STAGE_COUNT];
+	// When the current stage started and how many faults there were then.
+	struct timespec started;
+	long started_faults;
+} Memory;
+
+// Image whose rows start on 64 byte boundaries, so kernels can read
+// and write them with full width aligned vector instructions.
+typedef struct {
+	Memory* mem;
+	size_t width, height;
+	// Bytes from the start of a row to the start of the next one.
+	size_t stride;
+	Layout layout;
+	// Number of planes, each of them stride * height bytes.
+	size_t planes;
+	uint8_t* data;
+	size_t size;
+} ImageBuffer;
+
+typedef enum {
+	OPERATOR_SOBEL,
+	OPERATOR_SOBEL_5X5,
+	OPERATOR_SCHARR,
+	OPERATOR_PREWITT,
+	OPERATOR_COUNT
+} EdgeOperator;
+
+// Ways of placing seeds on the image.
+typedef enum {
+	SEEDER_QUADTREE,
+	SEEDER_POISSON,
+	SEEDER_IMPORTANCE,
+	SEEDER_COMPONENTS,
+	SEEDER_SLIC,
+	SEEDER_COUNT
+} Seeder;
+
+// What the quadtree looks at to decide if a sector should be split.
+typedef enum {
+	SPLIT_EDGES,
+	SPLIT_VARIANCE,
+	SPLIT_COUNT
+} SplitMode;
+
+// Morphological operations applied to the edge map.
+typedef enum {
+	MORPH_NONE,
+	MORPH_DILATE,
+	MORPH_ERODE,
+	MORPH_OPEN,
+	MORPH_CLOSE,
+	MORPH_COUNT
+} Morphology;
+
+// Settings of one run of the pipeline.
+typedef struct {
+	int threshold;
+	// Radius of the blur applied before edge detection (0 disables it).
+	int blur_radius;
+	EdgeOperator op;
+	// Number of levels of the edge detection pyramid (1 disables it).
+	int pyramid_levels;
+	// Cleanup of the edge map and the radius it works with.
+	Morphology morph;
+	int morph_radius;
+	// Files to read the quadtree from or write it to (NULL if none).
+	const char* tree_in;
+	const char* tree_out;
+	// Whether seeds are sorted in morton order before stylizing.
+	int sort_seeds;
+	// Whether the time and cache misses of stylizing go to the log.
+	int profile;
+	// Exact number of seeds to place, or 0 to place as many as needed.
+	// The poisson and components seeders can't be given one.
+	size_t seed_budget;
+	Seeder seeder;
+	// What the quadtree seeder splits sectors on.
+	SplitMode split;
+	// Largest color variance of a quadtree leaf when splitting on it.
+	double tolerance;
+	// Spacing of poisson-disk seeds near edges and away from them.
+	float min_radius, max_radius;
+	// How much SLIC favors compact cells over following colors.
+	float compactness;
+} ArtisticParams;
+
+// Everything a run of the pipeline keeps between its stages.
+// Contexts share nothing, so each thread can run its own at once.
+typedef struct {
+	Memory mem;
+	// Free lists of the memory when the context was set up with a pool.
+	Pool pool;
+	// Where the stages report what they did, or NULL to stay quiet.
+	FILE* log;
+	// Number of seeds placed by the last run.
+	size_t seed_count;
+} ArtisticContext;
+
+// Seeds placed on an image, in memory taken from the given one.
+typedef struct {
+	Memory* mem;
+	Point* data;
+	size_t count;
+	size_t capacity;
+} SeedList;
+
+// What a run of the pipeline has worked out so far, so that its steps
+// can be taken one at a time, even with different contexts on different
+// threads. Buffers go back to the memory of the step that made them.
+typedef struct {
+	ImageView in;
+	// Blurred image, edges and gradient magnitudes found by
+	// artistic_detect_edges() in the given memory, for the seeders.
+	Memory* edges_mem;
+	ImageView smooth;
+	ImageView edges;
+	uint32_t* magnitudes;
+	// Seeds placed by artistic_place_seeds(), for artistic_stylize().
+	SeedList seeds;
+	size_t seed_count;
+} ArtisticRun;
+
+// Outcome of a run of the pipeline.
+typedef enum {
+	ARTISTIC_OK,
+	// The input and output images don't have the same sizes.
+	ARTISTIC_SIZE_MISMATCH,
+	// The quadtree file couldn't be read or is for another image size.
+	ARTISTIC_TREE_UNREADABLE,
+	// The quadtree file couldn't be written.
+	ARTISTIC_TREE_UNWRITABLE,
+	// There wasn't enough memory left, and the run has been ended.
+	ARTISTIC_OUT_OF_MEMORY
+} ArtisticStatus;
+
+void artistic_default_params(ArtisticParams* params);
+int artistic_check_params(const ArtisticParams* params);
+void artistic_init(ArtisticContext* ctx, AllocatorKind allocator);
+void artistic_free(ArtisticContext* ctx);
+ArtisticStatus artistic_run(
+	ArtisticContext* ctx, const ArtisticParams* params,
+	ImageView in, ImageView out
+);
+
+void artistic_begin(ArtisticRun* run, ImageView in);
+ArtisticStatus artistic_detect_edges(
+	ArtisticContext* ctx, const ArtisticParams* params, ArtisticRun* run
+);
+ArtisticStatus artistic_place_seeds(
+	ArtisticContext* ctx, const ArtisticParams* params, ArtisticRun* run
+);
+ArtisticStatus artistic_stylize(
+	ArtisticContext* ctx, const ArtisticParams* params, ArtisticRun* run,
+	ImageView out
+);
+void artistic_end(ArtisticRun* run);
+
+int find_seeder(const char* name);
+int find_allocator(const char* name);
+int find_edge_operator(const char* name);
+int find_morphology(const char* name);
+
+void* mem_alloc(Memory* mem, size_t size);
+void mem_free(Memory* mem, void* ptr, size_t size);
+void print_memory(FILE* log, const Memory* mem);
+void print_pool(FILE* log, const Pool* pool);
+
+ImageView image_view(Rgb* data, size_t width, size_t height);
+ImageView crop_view(
+	ImageView view, size_t x, size_t y, size_t width, size_t height
+);
+ImageView alloc_view(Memory* mem, size_t width, size_t height);
+void free_view(Memory* mem, ImageView view);
+
+int image_buffer_init(
+	Memory* mem, ImageBuffer* image,
+	size_t width, size_t height, Layout layout
+);
+void image_buffer_free(ImageBuffer* image);
+void image_buffer_from_rgb(ImageBuffer* image, ImageView in);
+void image_buffer_to_rgb(const ImageBuffer* image, ImageView out);
+
+/**
+ * Get the start of a row of the given view.
+ */
+static inline Rgb* view_row(ImageView view, size_t row) {
+	return view.data + row * view.stride;
+}
+
+/**
+ * Get the start of a row of one of the planes of an image buffer.
+ *
+ * Buffers that are not planar only have plane 0.
+ */
+static inline uint8_t* image_buffer_row(
+	const ImageBuffer* image, size_t plane, size_t row
+) {
+	return image->data + (plane * image->height + row) * image->stride;
+}
+
+#endif
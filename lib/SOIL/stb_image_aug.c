@@ -325,7 +325,36 @@ extern int      stbi_is_hdr_from_file(FILE *f)
 extern int      stbi_info            (char const *filename,           int *x, int *y, int *comp);
 extern int      stbi_info_from_file  (FILE *f,                  int *x, int *y, int *comp);
 #endif
-extern int      stbi_info_from_memory(stbi_uc const *buffer, int len, int *x, int *y, int *comp);
+
+// reads only as far as the header, testing formats in the same order as
+// stbi_load_from_memory, so that callers can turn down huge images
+int stbi_info_from_memory(stbi_uc const *buffer, int len, int *x, int *y, int *comp)
+{
+   int i;
+   if (stbi_jpeg_test_memory(buffer,len))
+      return stbi_jpeg_info_from_memory(buffer,len,x,y,comp);
+   if (stbi_png_test_memory(buffer,len))
+      return stbi_png_info_from_memory(buffer,len,x,y,comp);
+   if (stbi_bmp_test_memory(buffer,len))
+      return stbi_bmp_info_from_memory(buffer,len,x,y,comp);
+   if (stbi_psd_test_memory(buffer,len))
+      return stbi_psd_info_from_memory(buffer,len,x,y,comp);
+   #ifndef STBI_NO_DDS
+   if (stbi_dds_test_memory(buffer,len))
+      return stbi_dds_info_from_memory(buffer,len,x,y,comp);
+   #endif
+   #ifndef STBI_NO_HDR
+   if (stbi_hdr_test_memory(buffer, len))
+      return stbi_hdr_info_from_memory(buffer,len,x,y,comp);
+   #endif
+   for (i=0; i < max_loaders; ++i)
+      if (loaders[i]->test_memory(buffer,len))
+         return e("no info", "Image type can't tell its size before decoding");
+   // test tga last because it's a crappy test!
+   if (stbi_tga_test_memory(buffer,len))
+      return stbi_tga_info_from_memory(buffer,len,x,y,comp);
+   return e("unknown image type", "Image not of any known type, or corrupt");
+}
 
 #ifndef STBI_NO_HDR
 static float h2l_gamma_i=1.0f/2.2f, h2l_scale_i=1.0f;
@@ -1594,7 +1623,17 @@ int stbi_jpeg_test_memory(stbi_uc const *buffer, int len)
 extern int      stbi_jpeg_info            (char const *filename,           int *x, int *y, int *comp);
 extern int      stbi_jpeg_info_from_file  (FILE *f,                  int *x, int *y, int *comp);
 #endif
-extern int      stbi_jpeg_info_from_memory(stbi_uc const *buffer, int len, int *x, int *y, int *comp);
+
+int stbi_jpeg_info_from_memory(stbi_uc const *buffer, int len, int *x, int *y, int *comp)
+{
+   jpeg j;
+   start_mem(&j.s, buffer,len);
+   if (!decode_jpeg_header(&j, SCAN_header)) return 0;
+   *x = j.s.img_x;
+   *y = j.s.img_y;
+   if (comp) *comp = j.s.img_n;
+   return 1;
+}
 
 // public domain zlib decode    v0.2  Sean Barrett 2006-11-18
 //    simple implementation
@@ -2431,7 +2470,17 @@ int stbi_png_test_memory(stbi_uc const *buffer, int len)
 extern int      stbi_png_info             (char const *filename,           int *x, int *y, int *comp);
 extern int      stbi_png_info_from_file   (FILE *f,                  int *x, int *y, int *comp);
 #endif
-extern int      stbi_png_info_from_memory (stbi_uc const *buffer, int len, int *x, int *y, int *comp);
+
+int stbi_png_info_from_memory (stbi_uc const *buffer, int len, int *x, int *y, int *comp)
+{
+   png p;
+   start_mem(&p.s, buffer, len);
+   if (!parse_png_file(&p, SCAN_header, STBI_default)) return 0;
+   *x = p.s.img_x;
+   *y = p.s.img_y;
+   if (comp) *comp = p.s.img_n;
+   return 1;
+}
 
 // Microsoft/Windows BMP image
 
@@ -2728,6 +2777,33 @@ stbi_uc *stbi_bmp_load_from_memory (stbi_uc const *buffer, int len, int *x, int
    return bmp_load(&s, x,y,comp,req_comp);
 }
 
+// reads the same header as bmp_load
+int      stbi_bmp_info_from_memory (stbi_uc const *buffer, int len, int *x, int *y, int *comp)
+{
+   stbi s;
+   int hsz, bpp;
+   start_mem(&s, buffer, len);
+   if (get8(&s) != 'B' || get8(&s) != 'M') return e("not BMP", "Corrupt BMP");
+   get32le(&s); // discard filesize
+   get16le(&s); // discard reserved
+   get16le(&s); // discard reserved
+   get32le(&s); // discard data offset
+   hsz = get32le(&s);
+   if (hsz != 12 && hsz != 40 && hsz != 56 && hsz != 108) return e("unknown BMP", "BMP type not supported: unknown");
+   if (hsz == 12) {
+      *x = get16le(&s);
+      *y = get16le(&s);
+   } else {
+      *x = get32le(&s);
+      *y = abs((int) get32le(&s));
+   }
+   if (get16le(&s) != 1) return e("bad BMP", "bad BMP");
+   bpp = get16le(&s);
+   if (bpp == 1) return e("monochrome", "BMP type not supported: 1-bit");
+   if (comp) *comp = bpp == 32 ? 4 : 3;
+   return 1;
+}
+
 // Targa Truevision - TGA
 // by Jonathan Dummer
 
@@ -3014,6 +3090,33 @@ stbi_uc *stbi_tga_load_from_memory (stbi_uc const *buffer, int len, int *x, int
    return tga_load(&s, x,y,comp,req_comp);
 }
 
+// reads the same header as tga_load
+int      stbi_tga_info_from_memory (stbi_uc const *buffer, int len, int *x, int *y, int *comp)
+{
+   stbi s;
+   int tga_indexed, tga_image_type, tga_palette_bits, tga_bits_per_pixel;
+   start_mem(&s, buffer, len);
+   get8u(&s);       // discard offset
+   tga_indexed = get8u(&s);
+   tga_image_type = get8u(&s);
+   get16le(&s);     // discard palette start
+   get16le(&s);     // discard palette length
+   tga_palette_bits = get8u(&s);
+   get16le(&s);     // discard x origin
+   get16le(&s);     // discard y origin
+   *x = get16le(&s);
+   *y = get16le(&s);
+   tga_bits_per_pixel = get8u(&s);
+   if (tga_image_type >= 8) tga_image_type -= 8;
+   if ((*x < 1) || (*y < 1) ||
+       (tga_image_type < 1) || (tga_image_type > 3) ||
+       ((tga_bits_per_pixel != 8) && (tga_bits_per_pixel != 16) &&
+       (tga_bits_per_pixel != 24) && (tga_bits_per_pixel != 32)))
+      return e("bad TGA", "Corrupt TGA");
+   if (comp) *comp = (tga_indexed ? tga_palette_bits : tga_bits_per_pixel) / 8;
+   return 1;
+}
+
 
 // *************************************************************************************************
 // Photoshop PSD loader -- PD by Thatcher Ulrich, integration by Nicholas Schulz, tweaked by STB
@@ -3228,6 +3331,25 @@ stbi_uc *stbi_psd_load_from_memory (stbi_uc const *buffer, int len, int *x, int
    return psd_load(&s, x,y,comp,req_comp);
 }
 
+// reads the same header as psd_load, which always decodes to 4 channels
+int stbi_psd_info_from_memory (stbi_uc const *buffer, int len, int *x, int *y, int *comp)
+{
+   stbi s;
+   int channelCount;
+   start_mem(&s, buffer, len);
+   if (get32(&s) != 0x38425053) return e("not PSD", "Corrupt PSD image");
+   if (get16(&s) != 1) return e("wrong version", "Unsupported version of PSD image");
+   skip(&s, 6);
+   channelCount = get16(&s);
+   if (channelCount < 0 || channelCount > 16) return e("wrong channel count", "Unsupported number of channels in PSD image");
+   *y = get32(&s);
+   *x = get32(&s);
+   if (get16(&s) != 8) return e("unsupported bit depth", "PSD bit depth is not 8 bit");
+   if (get16(&s) != 3) return e("wrong color format", "PSD is not in RGB color format");
+   if (comp) *comp = 4;
+   return 1;
+}
+
 
 // *************************************************************************************************
 // Radiance RGBE HDR loader
@@ -3561,6 +3683,34 @@ float *stbi_hdr_load_from_memory(stbi_uc const *buffer, int len, int *x, int *y,
    return hdr_load(&s,x,y,comp,req_comp);
 }
 
+// reads the same header as hdr_load
+int stbi_hdr_info_from_memory(stbi_uc const *buffer, int len, int *x, int *y, int *comp)
+{
+   stbi s;
+   char token_buffer[HDR_BUFLEN];
+   char *token;
+   int valid = 0;
+   start_mem(&s,buffer, len);
+   if (strcmp(hdr_gettoken(&s,token_buffer), "#?RADIANCE") != 0)
+      return e("not HDR", "Corrupt HDR image");
+   while(1) {
+      token = hdr_gettoken(&s,token_buffer);
+      if (token[0] == 0) break;
+      if (strcmp(token, "FORMAT=32-bit_rle_rgbe") == 0) valid = 1;
+   }
+   if (!valid) return e("unsupported format", "Unsupported HDR format");
+   token = hdr_gettoken(&s,token_buffer);
+   if (strncmp(token, "-Y ", 3)) return e("unsupported data layout", "Unsupported HDR format");
+   token += 3;
+   *y = strtol(token, &token, 10);
+   while (*token == ' ') ++token;
+   if (strncmp(token, "+X ", 3)) return e("unsupported data layout", "Unsupported HDR format");
+   token += 3;
+   *x = strtol(token, NULL, 10);
+   if (comp) *comp = 3;
+   return 1;
+}
+
 stbi_uc *stbi_hdr_load_rgbe_memory(stbi_uc *buffer, int len, int *x, int *y, int *comp, int req_comp)
 {
    stbi s;
@@ -271,6 +271,7 @@ extern int      stbi_bmp_test_memory      (stbi_uc const *buffer, int len);
 
 extern stbi_uc *stbi_bmp_load             (char const *filename,     int *x, int *y, int *comp, int req_comp);
 extern stbi_uc *stbi_bmp_load_from_memory (stbi_uc const *buffer, int len, int *x, int *y, int *comp, int req_comp);
+extern int      stbi_bmp_info_from_memory (stbi_uc const *buffer, int len, int *x, int *y, int *comp);
 #ifndef STBI_NO_STDIO
 extern int      stbi_bmp_test_file        (FILE *f);
 extern stbi_uc *stbi_bmp_load_from_file   (FILE *f,                  int *x, int *y, int *comp, int req_comp);
@@ -281,6 +282,7 @@ extern int      stbi_tga_test_memory      (stbi_uc const *buffer, int len);
 
 extern stbi_uc *stbi_tga_load             (char const *filename,     int *x, int *y, int *comp, int req_comp);
 extern stbi_uc *stbi_tga_load_from_memory (stbi_uc const *buffer, int len, int *x, int *y, int *comp, int req_comp);
+extern int      stbi_tga_info_from_memory (stbi_uc const *buffer, int len, int *x, int *y, int *comp);
 #ifndef STBI_NO_STDIO
 extern int      stbi_tga_test_file        (FILE *f);
 extern stbi_uc *stbi_tga_load_from_file   (FILE *f,                  int *x, int *y, int *comp, int req_comp);
@@ -291,6 +293,7 @@ extern int      stbi_psd_test_memory      (stbi_uc const *buffer, int len);
 
 extern stbi_uc *stbi_psd_load             (char const *filename,     int *x, int *y, int *comp, int req_comp);
 extern stbi_uc *stbi_psd_load_from_memory (stbi_uc const *buffer, int len, int *x, int *y, int *comp, int req_comp);
+extern int      stbi_psd_info_from_memory (stbi_uc const *buffer, int len, int *x, int *y, int *comp);
 #ifndef STBI_NO_STDIO
 extern int      stbi_psd_test_file        (FILE *f);
 extern stbi_uc *stbi_psd_load_from_file   (FILE *f,                  int *x, int *y, int *comp, int req_comp);
@@ -301,6 +304,7 @@ extern int      stbi_hdr_test_memory      (stbi_uc const *buffer, int len);
 
 extern float *  stbi_hdr_load             (char const *filename,     int *x, int *y, int *comp, int req_comp);
 extern float *  stbi_hdr_load_from_memory (stbi_uc const *buffer, int len, int *x, int *y, int *comp, int req_comp);
+extern int      stbi_hdr_info_from_memory (stbi_uc const *buffer, int len, int *x, int *y, int *comp);
 extern stbi_uc *stbi_hdr_load_rgbe        (char const *filename,           int *x, int *y, int *comp, int req_comp);
 extern float *  stbi_hdr_load_from_memory (stbi_uc const *buffer, int len, int *x, int *y, int *comp, int req_comp);
 #ifndef STBI_NO_STDIO
@@ -10,6 +10,7 @@ extern int      stbi_dds_test_memory      (stbi_uc const *buffer, int len);
 
 extern stbi_uc *stbi_dds_load             (char *filename,           int *x, int *y, int *comp, int req_comp);
 extern stbi_uc *stbi_dds_load_from_memory (stbi_uc const *buffer, int len, int *x, int *y, int *comp, int req_comp);
+extern int      stbi_dds_info_from_memory (stbi_uc const *buffer, int len, int *x, int *y, int *comp);
 #ifndef STBI_NO_STDIO
 extern int      stbi_dds_test_file        (FILE *f);
 extern stbi_uc *stbi_dds_load_from_file   (FILE *f,                  int *x, int *y, int *comp, int req_comp);
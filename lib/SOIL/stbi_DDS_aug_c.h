@@ -509,3 +509,20 @@ stbi_uc *stbi_dds_load_from_memory (stbi_uc const *buffer, int len, int *x, int
    start_mem(&s,buffer, len);
    return dds_load(&s,x,y,comp,req_comp);
 }
+
+//	reads the same header as dds_load, and counts every face of a cubemap
+int      stbi_dds_info_from_memory (stbi_uc const *buffer, int len, int *x, int *y, int *comp)
+{
+	DDS_header header;
+	int cubemap_faces;
+	if( len < (int)sizeof( DDS_header ) ) return 0;
+	memcpy( &header, buffer, sizeof( DDS_header ) );
+	if( header.dwMagic != (('D' << 0) | ('D' << 8) | ('S' << 16) | (' ' << 24)) ) return 0;
+	if( header.dwSize != 124 ) return 0;
+	cubemap_faces = (header.sCaps.dwCaps2 & DDSCAPS2_CUBEMAP) / DDSCAPS2_CUBEMAP;
+	cubemap_faces &= (header.dwWidth == header.dwHeight);
+	*x = header.dwWidth;
+	*y = header.dwHeight * (cubemap_faces ? 6 : 1);
+	if( comp ) *comp = 4;
+	return 1;
+}
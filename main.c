@@ -1,16 +1,38 @@
 /* main.c */
-#include <float.h>
-#include <math.h>
-#include <stddef.h>
+#include <ctype.h>
+#include <limits.h>
+#include <stdatomic.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
+
+#include <dirent.h>
+#include <sys/stat.h>
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <errno.h>
+#include <sched.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <unistd.h>
+#define HAVE_POSIX 1
+#endif
 
 #ifdef WIN32
+#include <fcntl.h>
+#include <io.h>
 #include <windows.h>
 #endif
 
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
 #ifdef __APPLE__
 #include <OpenGL/gl.h>
 #include <OpenGL/glu.h>
@@ -22,56 +44,232 @@
 #endif
 
 #include "SOIL.h"
-
-typedef struct {
-    unsigned char r, g, b;
-} Rgb;
+#include "lib/SOIL/stb_image_aug.h"
+#include "artistic.h"
 
 typedef struct {
     int width, height;
     Rgb* data;
 } ImageRgb;
 
-typedef struct point {
-	size_t x;
-	size_t y;
-} Point;
+// Largest amount of data a stored deflate block can hold.
+enum { png_block_size = 65535 };
+
+// Stored deflate stream of a PNG being written.
+typedef struct {
+	FILE* file;
+	// Bytes in the current block, and bytes still to come after them.
+	size_t used;
+	uint32_t adler;
+	uint64_t remaining;
+	// Block header, data, and room for the checksum after the last one.
+	uint8_t block[5 + png_block_size + 4];
+} PngStream;
+
+// Contents of a file, read into memory or mapped into it.
+typedef struct {
+	uint8_t* data;
+	size_t size;
+	size_t capacity;
+	// Whether the data is a mapping of the file rather than a buffer.
+	int mapped;
+} Bytes;
+
+// An image of a batch and the edge detection threshold it gets.
+typedef struct {
+	char* path;
+	int threshold;
+} BatchItem;
+
+typedef struct {
+	BatchItem* items;
+	size_t count;
+	size_t capacity;
+} Batch;
+
+// The file name an image of a batch is written to, without its extension.
+typedef struct {
+	const char* name;
+	int length;
+	// The image it is the result of.
+	const char* path;
+} OutputName;
+
+// Stages of a pipelined batch, each of them on its own threads.
+typedef enum {
+	STEP_DECODE,
+	STEP_EDGES,
+	STEP_SEEDS,
+	STEP_STYLIZE,
+	STEP_ENCODE,
+	STEP_COUNT
+} Step;
+
+// An image on its way through the stages of a pipelined batch.
+typedef struct {
+	const BatchItem* item;
+	ArtisticParams params;
+	ArtisticRun run;
+	// Result of the stylize stage and the memory it came from.
+	Memory* out_mem;
+	ImageView out;
+	// When the image started being loaded.
+	struct timespec start;
+} PipelineJob;
+
+// A slot of a queue, along with the position it is next used at.
+typedef struct {
+	atomic_size_t sequence;
+	void* item;
+} QueueCell;
+
+// Bounded queue many threads can push to and pop from without locks.
+typedef struct {
+	QueueCell* cells;
+	size_t mask;
+	// Kept on cache lines of their own, since producers move the head
+	// and consumers move the tail from different cores.
+	_Alignas(64) atomic_size_t head;
+	_Alignas(64) atomic_size_t tail;
+} Queue;
 
-static const Rgb BLACK = (Rgb) {0, 0, 0};
-static const Rgb WHITE = (Rgb) {255, 255, 255};
+typedef struct {
+	char* source;
+	ArtisticParams params;
+	// Where the stages get their memory from.
+	AllocatorKind allocator;
+	// File to write the result to without opening a window, or NULL.
+	char* output;
+	// Whether the source is a directory or a list of images to stylize,
+	// on how many worker threads (0 for one per core) and where to.
+	int batch;
+	int jobs;
+	char* out_dir;
+	// Whether a batch runs as a pipeline, with how many threads per stage.
+	int pipelined;
+	int step_threads[STEP_COUNT];
+	// Whether to serve requests on the unix socket at the source path,
+	// or the socket to send the source image to, or NULL.
+	int serve;
+	char* client;
+} Options;
 
 void load(char* name, ImageRgb* pic);
-void validate();
+int read_bytes(FILE* file, Bytes* bytes);
+void free_bytes(Bytes* bytes);
+FILE* claim_stdout();
+void parse_args(int argc, char** argv, Options* opts);
+int parse_param(int argc, char** argv, int* i, ArtisticParams* params);
+void usage();
 
-void stylize(
-	size_t width, size_t height, Rgb in[][width], Rgb out[][width], Point* seeds
+size_t run_batch(const Options* opts);
+static int run_batch_item(
+	ArtisticContext* ctx, const Options* opts, const BatchItem* item
 );
-
-void find_seeds(
-	Point* seeds, size_t width, size_t height, Rgb edges[][width]
+static size_t run_workers(const Options* opts, const Batch* batch);
+static size_t run_pipeline(const Options* opts, const Batch* batch);
+#ifdef _OPENMP
+static size_t run_step(
+	ArtisticContext* ctx, const Options* opts, const Batch* batch,
+	size_t* next, Step step, Queue* queues
 );
-
-static void find_seeds_step(
-	Point* seeds,
-	size_t start_x, size_t start_y,
-	size_t end_x, size_t end_y,
-	Rgb edges[][end_x]
+static PipelineJob* decode_job(const BatchItem* item, const Options* opts);
+static int encode_job(PipelineJob* job, const Options* opts);
+static void drop_job(PipelineJob* job, ArtisticStatus status);
+#endif
+int read_batch(Batch* batch, const char* source, int threshold);
+void free_batch(Batch* batch);
+static void batch_push(Batch* batch, const char* path, int threshold);
+static int compare_items(const void* a, const void* b);
+static int is_image_name(const char* name);
+static void batch_output_path(
+	char* out, size_t size, const char* dir, const char* path
 );
+static OutputName output_name(const char* path);
+static int compare_output_names(const void* a, const void* b);
+static int check_outputs(const Batch* batch);
 
-void detect_edges(
-	size_t width, size_t height,
-	Rgb in[][width], Rgb out[][width],
-	int threshold
+int serve(const Options* opts);
+int run_client(const Options* opts, int argc, char** argv);
+static int save_encoded(const char* path, FILE* piped, const Bytes* png);
+int reserve_bytes(Bytes* bytes, size_t capacity);
+static uint32_t load_be32(const uint8_t* bytes);
+
+#ifdef HAVE_POSIX
+static int serve_request(
+	ArtisticContext* ctx, const ArtisticParams* defaults,
+	Bytes* request, int fd
 );
+static int parse_request_params(char* text, ArtisticParams* params);
+static int send_reply(int fd, uint32_t status, const void* data, size_t size);
+static int read_full(int fd, void* data, size_t size);
+static int write_full(int fd, const void* data, size_t size);
+#endif
 
-static int convolute(Rgb pixels[], int size, const int kernel[]);
+void queue_init(Queue* queue, size_t capacity);
+void queue_free(Queue* queue);
+int queue_try_push(Queue* queue, void* item);
+int queue_try_pop(Queue* queue, void** item);
+void queue_push(Queue* queue, void* item);
+void* queue_pop(Queue* queue);
+static void queue_backoff(unsigned* attempts);
+
+int save_image(const char* path, ImageView image);
+static int has_extension(const char* path, const char* extension);
+int write_png(const char* path, ImageView image);
+int write_png_stream(FILE* file, ImageView image);
+static void png_store(PngStream* stream, const uint8_t* bytes, size_t length);
+static void write_png_chunk(
+	FILE* file, const char type[4], const uint8_t* data, size_t length
+);
+static uint32_t update_crc32(
+	uint32_t crc, const uint8_t* bytes, size_t length
+);
+static void update_adler32(
+	uint32_t* adler, const uint8_t* bytes, size_t length
+);
+static void store_be32(uint8_t* bytes, uint32_t value);
 void init();
 void draw();
 void keyboard(unsigned char key, int x, int y);
 
 int width, height;
-size_t max_seeds = 80000;
-size_t seeds_found = 0;
+
+#ifdef _OPENMP
+static const char* step_names[] = {
+	"decode", "edges", "seeds", "stylize", "encode"
+};
+#endif
+
+// Marks the requests sent to the server ("ART1").
+static const uint32_t request_magic = 0x41525431;
+// Longest text of the options of a request, and most words in it.
+enum { request_params_max = 4096, request_args_max = 64 };
+// Largest encoded image a request can carry, and most pixels it can
+// decode to, so that no client can take all of the memory of the server.
+static const size_t request_image_max = 64 << 20;
+static const size_t request_pixels_max = 1 << 24;
+// Most seeds and widest blur and morphology a request can ask for, as
+// the cost of stylizing grows with every seed on top of every pixel.
+static const size_t request_seeds_max = 1 << 16;
+static const int request_radius_max = 64;
+// Seconds a worker waits on a connection that sends or takes nothing
+// before hanging up, so idle clients can't hold on to every worker.
+static const int request_timeout = 30;
+// Connections the server lets wait before its workers take them.
+static const int server_backlog = 16;
+// Shortest and longest pause of a worker after accepting a connection
+// fails, so that running out of descriptors doesn't keep it spinning.
+static const long accept_pause_min_ns = 1000000;
+static const long accept_pause_max_ns = 1000000000;
+
+// Size of the buffer an image is first read into from a pipe.
+static const size_t read_chunk = 64 << 10;
+
+// Times a thread gives up the processor waiting on a queue
+// before it starts sleeping, and for how long it sleeps then.
+static const unsigned queue_spins = 64;
+static const long queue_sleep_ns = 100000;
 
 // Texture identifiers.
 GLuint tex[2];
@@ -82,45 +280,101 @@ int sel;
 
 int main(int argc, char** argv)
 {
-    if(argc < 3) {
-        printf("artistic [source image] [edge detection threshold]\n");
-        exit(1);
-    }
+    Options opts;
+    parse_args(argc, argv, &opts);
+
+	if (opts.batch) {
+		return run_batch(&opts) > 0;
+	} else if (opts.serve) {
+		return serve(&opts);
+	} else if (opts.client) {
+		return run_client(&opts, argc, argv);
+	}
+
+	ArtisticContext ctx;
+	artistic_init(&ctx, opts.allocator);
+	ctx.log = stdout;
 
-	glutInit(&argc,argv);
-	glutInitDisplayMode(GLUT_DOUBLE | GLUT_RGB);
+	// Without a window, GL is never touched.
+	const int headless = opts.output != NULL;
+	// The image written to stdout can't share it with the messages.
+	FILE* piped = NULL;
+
+	if (headless && strcmp(opts.output, "-") == 0) {
+		piped = claim_stdout();
+	}
+
+	if (!headless) {
+		glutInit(&argc,argv);
+		glutInitDisplayMode(GLUT_DOUBLE | GLUT_RGB);
+	}
 
-    load(argv[1], &imgs[0]);
+    load(opts.source, &imgs[0]);
     width = imgs[0].width;
     height = imgs[0].height;
     // The input and output images must have the same sizes.
     imgs[1].width  = imgs[0].width;
     imgs[1].height = imgs[0].height;
-	imgs[1].data = calloc(imgs[1].width * imgs[1].height, 3);
+    imgs[1].data = malloc(sizeof(Rgb) * width * height);
 
-	glutInitWindowSize(width, height);
-	glutCreateWindow("Artistic");
-	glutDisplayFunc(draw);
-	glutKeyboardFunc(keyboard);
-	glMatrixMode(GL_PROJECTION);
-	gluOrtho2D(0.0, width, height, 0.0);
-	glMatrixMode(GL_MODELVIEW);
+	if (!imgs[1].data) {
+		printf("Out of memory allocating the output image\n");
+		exit(1);
+	}
+
+	if (!headless) {
+		glutInitWindowSize(width, height);
+		glutCreateWindow("Artistic");
+		glutDisplayFunc(draw);
+		glutKeyboardFunc(keyboard);
+		glMatrixMode(GL_PROJECTION);
+		gluOrtho2D(0.0, width, height, 0.0);
+		glMatrixMode(GL_MODELVIEW);
+	}
 
-    printf("Source      : %s %d x %d\n", argv[1], imgs[0].width, imgs[0].height);
+    printf("Source      : %s %d x %d\n", opts.source, imgs[0].width, imgs[0].height);
     sel = 0;
 
-    // Interpret the images as rgb matrixes.
-    Rgb (*in)[width] = (Rgb(*)[width]) imgs[0].data;
-    Rgb (*out)[width] = (Rgb(*)[width]) imgs[1].data;
+	ImageView in = image_view(imgs[0].data, width, height);
+	ImageView out = image_view(imgs[1].data, width, height);
+
+	switch (artistic_run(&ctx, &opts.params, in, out)) {
+	case ARTISTIC_TREE_UNREADABLE:
+		printf("Tree error  : can't use '%s'\n", opts.params.tree_in);
+		exit(1);
+	case ARTISTIC_TREE_UNWRITABLE:
+		printf("Tree error  : can't write '%s'\n", opts.params.tree_out);
+		exit(1);
+	case ARTISTIC_OUT_OF_MEMORY:
+		printf("Out of memory stylizing '%s'\n", opts.source);
+		exit(1);
+	default:
+		break;
+	}
+
+	print_memory(ctx.log, &ctx.mem);
+
+	if (opts.allocator == ALLOC_POOL) {
+		print_pool(ctx.log, &ctx.pool);
+	}
+
+	artistic_free(&ctx);
 
-	Rgb edges[height][width];
-	detect_edges(width, height, in, edges, atol(argv[2]));
+	if (headless) {
+		int saved = piped
+			? write_png_stream(piped, out) && fclose(piped) == 0
+			: save_image(opts.output, out);
 
-	Point seeds[max_seeds];
-	find_seeds(seeds, width, height, edges);
-	printf("Seeds found : %zu\n", seeds_found);
+		if (!saved) {
+			printf("Save error  : can't write '%s'\n", opts.output);
+			exit(1);
+		}
 
-	stylize(width, height, in, out, seeds);
+		printf("Output      : %s\n", opts.output);
+		SOIL_free_image_data((unsigned char*) imgs[0].data);
+		free(imgs[1].data);
+		return 0;
+	}
 
     tex[0] = SOIL_create_OGL_texture(
 		(unsigned char*) imgs[0].data, width, height,
@@ -136,239 +390,2002 @@ int main(int argc, char** argv)
 }
 
 /**
- * Stylize the given image based on its seeds into a voronoi diagram
- * using the euclidean distance as a metric.
- *
- * Performs badly because every pixel calculates its distance to every seed.
+ * Read the command line arguments into the given options,
+ * exiting with a usage message if they are invalid.
  */
-void stylize(
-	size_t width, size_t height, Rgb in[][width], Rgb out[][width], Point* seeds
-) {
-	for (size_t row = 0; row < height; row++) {
-		for (size_t col = 0; col < width; col++) {
-			Point closest_seed = seeds[0];
-			int closest_dist = INT32_MAX;
+void parse_args(int argc, char** argv, Options* opts) {
+	if (argc < 3) {
+		usage();
+	}
+
+	opts->source = argv[1];
+	artistic_default_params(&opts->params);
+	opts->params.threshold = atol(argv[2]);
+	opts->allocator = ALLOC_MALLOC;
+	opts->output = NULL;
+	opts->batch = 0;
+	opts->jobs = 0;
+	opts->out_dir = ".";
+	opts->pipelined = 0;
+	opts->serve = 0;
+	opts->client = NULL;
 
-			for (size_t i = 0; i < seeds_found; i++) {
-				Point seed = seeds[i];
+	for (int i = 3; i < argc; i++) {
+		if (parse_param(argc, argv, &i, &opts->params)) {
+			continue;
+		} else if (strcmp(argv[i], "--load-tree") == 0 && i + 1 < argc) {
+			opts->params.tree_in = argv[++i];
+		} else if (strcmp(argv[i], "--save-tree") == 0 && i + 1 < argc) {
+			opts->params.tree_out = argv[++i];
+		} else if (strcmp(argv[i], "--profile") == 0) {
+			opts->params.profile = 1;
+		} else if (strcmp(argv[i], "--alloc") == 0 && i + 1 < argc) {
+			int allocator = find_allocator(argv[++i]);
 
-				int dx = (int) col - (int) seed.x;
-				int dy = (int) row - (int) seed.y;
-				int dist = dx*dx + dy*dy;
+			if (allocator < 0) {
+				usage();
+			}
+
+			opts->allocator = allocator;
+		} else if ((strcmp(argv[i], "-o") == 0
+				|| strcmp(argv[i], "--output") == 0) && i + 1 < argc) {
+			opts->output = argv[++i];
+		} else if (strcmp(argv[i], "--batch") == 0) {
+			opts->batch = 1;
+		} else if (strcmp(argv[i], "--jobs") == 0 && i + 1 < argc) {
+			opts->jobs = atol(argv[++i]);
+		} else if (strcmp(argv[i], "--out-dir") == 0 && i + 1 < argc) {
+			opts->out_dir = argv[++i];
+		} else if (strcmp(argv[i], "--serve") == 0) {
+			opts->serve = 1;
+		} else if (strcmp(argv[i], "--client") == 0 && i + 1 < argc) {
+			opts->client = argv[++i];
+		} else if (strcmp(argv[i], "--pipeline") == 0 && i + 1 < argc) {
+			int* threads = opts->step_threads;
+			opts->pipelined = 1;
+
+			if (sscanf(argv[++i], "%d:%d:%d:%d:%d",
+					&threads[0], &threads[1], &threads[2],
+					&threads[3], &threads[4]) != STEP_COUNT) {
+				usage();
+			}
 
-				if (dist < closest_dist) {
-					closest_seed = seed;
-					closest_dist = dist;
+			for (int s = 0; s < STEP_COUNT; s++) {
+				if (threads[s] < 1) {
+					usage();
 				}
 			}
+		} else {
+			usage();
+		}
+	}
+
+	// Every image of a batch or of a server would share
+	// the same quadtree file.
+	const int shared = opts->batch || opts->serve || opts->client;
+
+	if (!artistic_check_params(&opts->params) || opts->jobs < 0
+			|| (opts->pipelined && !opts->batch)
+			|| opts->batch + opts->serve + (opts->client != NULL) > 1
+			|| (shared && (opts->params.tree_in || opts->params.tree_out))
+			|| ((opts->batch || opts->serve) && opts->output)
+			|| (opts->client && !opts->output)) {
+		usage();
+	}
+}
+
+/**
+ * Read the option at argv[*i] into the given parameters if it is
+ * one of the options of the pipeline, moving *i past its value.
+ *
+ * Returns 0 if it is not, or if its value is invalid.
+ */
+int parse_param(int argc, char** argv, int* i, ArtisticParams* params) {
+	const char* name = argv[*i];
+
+	if (strcmp(name, "--no-sort") == 0) {
+		params->sort_seeds = 0;
+		return 1;
+	}
+
+	// Every other option takes a value.
+	if (*i + 1 >= argc) {
+		return 0;
+	}
+
+	const char* value = argv[*i + 1];
+
+	if (strcmp(name, "--blur") == 0) {
+		params->blur_radius = atol(value);
+	} else if (strcmp(name, "--operator") == 0) {
+		int op = find_edge_operator(value);
+
+		if (op < 0) {
+			return 0;
+		}
+
+		params->op = op;
+	} else if (strcmp(name, "--pyramid") == 0) {
+		params->pyramid_levels = atol(value);
+	} else if (strcmp(name, "--morph") == 0) {
+		char morph_name[16];
+		char extra;
+		int morph;
+		// Either the bare name, keeping the radius, or the name and a radius.
+		int fields = sscanf(
+			value, "%15[^:]:%d%c", morph_name, &params->morph_radius, &extra
+		);
+
+		if ((fields != 2 && (fields != 1 || strchr(value, ':')))
+				|| (morph = find_morphology(morph_name)) < 0) {
+			return 0;
+		}
+
+		params->morph = morph;
+	} else if (strcmp(name, "--seeds") == 0) {
+		params->seed_budget = strtoull(value, NULL, 10);
+	} else if (strcmp(name, "--seeder") == 0) {
+		int seeder = find_seeder(value);
+
+		if (seeder < 0) {
+			return 0;
+		}
 
-			out[row][col] = in[closest_seed.y][closest_seed.x];
+		params->seeder = seeder;
+	} else if (strcmp(name, "--split") == 0) {
+		if (strcmp(value, "edges") == 0) {
+			params->split = SPLIT_EDGES;
+		} else if (strcmp(value, "variance") == 0) {
+			params->split = SPLIT_VARIANCE;
+		} else {
+			return 0;
 		}
+	} else if (strcmp(name, "--tolerance") == 0) {
+		char* end;
+		params->tolerance = strtod(value, &end);
+
+		if (end == value || *end) {
+			return 0;
+		}
+	} else if (strcmp(name, "--radius") == 0) {
+		if (sscanf(value, "%f:%f",
+				&params->min_radius, &params->max_radius) != 2) {
+			return 0;
+		}
+	} else if (strcmp(name, "--compactness") == 0) {
+		params->compactness = atof(value);
+	} else {
+		return 0;
 	}
+
+	(*i)++;
+	return 1;
+}
+
+void usage() {
+	printf("artistic [source image] [edge detection threshold] [options]\n");
+	printf("\n");
+	printf("The source image is read from stdin if it is -.\n");
+	printf("\n");
+	printf("options:\n");
+	printf("  --blur <radius>    smooth the image before detecting edges\n");
+	printf("  --operator <name>  sobel (default), sobel5x5, scharr or prewitt\n");
+	printf("  --pyramid <levels> detect edges on this many scales, e.g. 3\n");
+	printf("  --morph <op[:r]>   dilate, erode, open or close the edges\n");
+	printf("                     with a square of radius r, 1 by default\n");
+	printf("  --save-tree <file> write the quadtree to a file\n");
+	printf("  --load-tree <file> reuse a saved quadtree instead of finding edges\n");
+	printf("  --seeds <count>    place exactly this many seeds with the\n");
+	printf("                     quadtree, importance or slic seeders only\n");
+	printf("  --seeder <name>    quadtree (default), poisson, importance,\n");
+	printf("                     components or slic\n");
+	printf("  --split <mode>     split quadtree sectors on edges (default)\n");
+	printf("                     or on their color variance\n");
+	printf("  --tolerance <var>  largest variance of a sector, 300 by default\n");
+	printf("  --radius <min:max> spacing of poisson seeds, 2:16 by default\n");
+	printf("  --compactness <m>  weight of distance against color for slic,\n");
+	printf("                     20 by default\n");
+	printf("  --alloc <name>     malloc (default), pool to reuse buffers\n");
+	printf("                     or mmap to map large ones on huge pages\n");
+	printf("  --no-sort          keep seeds in the order they were found\n");
+	printf("  --profile          log the time and cache misses of stylizing\n");
+	printf("  -o <file>          write the result to a png, bmp, tga or dds\n");
+	printf("                     file and exit without opening a window,\n");
+	printf("                     or as a png to stdout if the file is -\n");
+	printf("  --batch            stylize every image of the source directory,\n");
+	printf("                     or of the source file listing one image per\n");
+	printf("                     line with an optional threshold after it\n");
+	printf("  --jobs <count>     images stylized at once, one per core by default\n");
+	printf("  --out-dir <dir>    where a batch writes its png results, . by default\n");
+	printf("  --pipeline <d:e:s:y:w> run a batch as a pipeline with this many\n");
+	printf("                     threads to decode, find edges, place seeds,\n");
+	printf("                     stylize and encode\n");
+	printf("  --serve            stylize images sent to the unix socket at the\n");
+	printf("                     source path on --jobs workers, with these\n");
+	printf("                     options unless a request gives its own\n");
+	printf("  --client <socket>  send the source image and these options to\n");
+	printf("                     a server and write what it sends back to -o\n");
+	exit(1);
 }
 
 /**
- * Start the process of finding seeds on a given image based on its edges.
+ * Stylize every image of a batch and log the outcome of each of them.
  *
- * This function exists to provide a simpler interface for the user.
+ * Returns the number of images that failed.
  */
-void find_seeds(
-	Point* seeds, size_t width, size_t height, Rgb edges[][width]
-) {
-	find_seeds_step(seeds, 0, 0, width, height, edges);
+size_t run_batch(const Options* opts) {
+	Batch batch = { NULL };
+
+	if (!read_batch(&batch, opts->source, opts->params.threshold)) {
+		printf("Batch error : can't read '%s'\n", opts->source);
+		exit(1);
+	}
+
+	if (!check_outputs(&batch)) {
+		exit(1);
+	}
+
+	struct timespec start, end;
+	timespec_get(&start, TIME_UTC);
+	size_t failed = opts->pipelined
+		? run_pipeline(opts, &batch) : run_workers(opts, &batch);
+
+	timespec_get(&end, TIME_UTC);
+	double seconds = (end.tv_sec - start.tv_sec)
+		+ (end.tv_nsec - start.tv_nsec) / 1e9;
+
+	printf(
+		"Batch       : %zu images, %zu failed, %.3f s\n",
+		batch.count, failed, seconds
+	);
+	free_batch(&batch);
+	return failed;
 }
 
 /**
- * Find spots appropriate for seeds that will be later used
- * to stylize an image.
+ * Stylize the images of a batch on a team of worker threads.
+ *
+ * Each worker takes the next image when it is done with the previous one
+ * and keeps its own context, so the memory of its stages is reused
+ * from one image to the next. The stages of a worker run on its thread
+ * alone, since the workers already keep every core busy.
  *
- * This function behaves like a quadtree, subdividing the space into
- * four quadrants each time it doesn't satisfy a condition.
- * In this case, that means being an area of pixels that are
- * all edges or all not edges.
+ * Returns the number of images that failed.
  */
-static void find_seeds_step(
-	Point* seeds,
-	size_t start_x, size_t start_y,
-	size_t end_x, size_t end_y,
-	Rgb edges[][end_x]
-) {
-	unsigned char first_color = edges[start_y][start_x].r;
-	size_t middle_x = (start_x + end_x) / 2;
-	size_t middle_y = (start_y + end_y) / 2;
-
-	for (size_t row = start_y; row < end_y; row++) {
-		for (size_t col = start_x; col < end_x; col++) {
-			// Check if this sector of the image is
-			// all edges or all not edges.
-			if (edges[row][col].r == first_color) {
-				continue;
-			}
+static size_t run_workers(const Options* opts, const Batch* batch) {
+	int jobs = opts->jobs;
 
-			// If not, divide it further into four sectors.
-			size_t boundaries[][4] = {
-				{ start_x,      start_y,      middle_x, middle_y },
-				{ middle_x + 1, start_y,      end_x,    middle_y },
-				{ start_x,      middle_y + 1, middle_x, end_y },
-				{ middle_x + 1, middle_y + 1, end_x,    end_y }
-			};
-
-			for (size_t i = 0; i < 4; i++) {
-				if (seeds_found == max_seeds) {
-					break;
-				}
+	if (jobs <= 0) {
+#ifdef _OPENMP
+		jobs = omp_get_num_procs();
+#else
+		jobs = 1;
+#endif
+	}
+
+	printf("Batch       : %zu images on %d workers\n", batch->count, jobs);
+
+	size_t next = 0;
+	size_t failed = 0;
+
+	#pragma omp parallel num_threads(jobs)
+	{
+#ifdef _OPENMP
+		omp_set_num_threads(1);
+#endif
+		ArtisticContext ctx;
+		artistic_init(&ctx, opts->allocator);
+
+		for (;;) {
+			size_t i;
 
-				find_seeds_step(
-					seeds,
-					boundaries[i][0],
-					boundaries[i][1],
-					boundaries[i][2],
-					boundaries[i][3],
-					edges
-				);
+			#pragma omp atomic capture
+			i = next++;
+
+			if (i >= batch->count) {
+				break;
 			}
 
-			return;
+			if (!run_batch_item(&ctx, opts, &batch->items[i])) {
+				#pragma omp atomic
+				failed++;
+			}
 		}
+
+		artistic_free(&ctx);
 	}
 
-	// If so, place a seed in this spot.
-	seeds[seeds_found] = (Point) { middle_x, middle_y };
-	seeds_found++;
+	return failed;
 }
 
 /**
- * Perform sobel edge detection on the given image.
- *
- * Unlike a standard implementation, this function transforms
- * gradient edge values into binary ones.
+ * Stylize the images of a batch with every stage on its own threads,
+ * connected by queues, so that reading and writing images overlaps
+ * with finding edges and stylizing the others.
  *
- * This is done to simplify further processing and is based
- * on the given threshold.
+ * Every thread keeps its own context. The buffers an image takes
+ * from one stage to the next go back to the context they came from.
  *
- * See also: https://en.wikipedia.org/wiki/Sobel_operator
+ * Returns the number of images that failed.
+ */
+static size_t run_pipeline(const Options* opts, const Batch* batch) {
+#ifndef _OPENMP
+	// A single thread can't keep every stage going at once.
+	printf("Pipeline    : ignored, built without OpenMP\n");
+	return run_workers(opts, batch);
+#else
+	int total = 0;
+	// Threads left on each stage, and the queue that feeds each stage.
+	int active[STEP_COUNT];
+	Queue queues[STEP_COUNT];
+
+	for (int s = 0; s < STEP_COUNT; s++) {
+		active[s] = opts->step_threads[s];
+		total += active[s];
+
+		if (s > 0) {
+			// Room for every thread on both sides to have one image ready.
+			size_t capacity = 1;
+
+			while (capacity < 2 * (size_t) (active[s - 1] + active[s])) {
+				capacity *= 2;
+			}
+
+			queue_init(&queues[s], capacity);
+		}
+	}
+
+	printf("Pipeline    :");
+
+	for (int s = 0; s < STEP_COUNT; s++) {
+		printf(" %d %s%s", active[s], step_names[s],
+			s + 1 < STEP_COUNT ? "," : " threads\n");
+	}
+
+	// Every stage needs a thread of its own, or the ones that are running
+	// end up waiting forever on the queues of the ones that are not.
+	omp_set_dynamic(0);
+
+	if (total > omp_get_thread_limit()) {
+		printf(
+			"Batch error : more than %d threads\n", omp_get_thread_limit()
+		);
+		exit(1);
+	}
+
+	// The contexts outlive the threads, since the buffers of one
+	// can still be on their way to another stage when it is done.
+	ArtisticContext* contexts = malloc(sizeof(ArtisticContext) * total);
+
+	if (!contexts) {
+		printf("Out of memory starting the pipeline\n");
+		exit(1);
+	}
+
+	for (int t = 0; t < total; t++) {
+		artistic_init(&contexts[t], opts->allocator);
+	}
+
+	size_t next = 0;
+	size_t failed = 0;
+
+	#pragma omp parallel num_threads(total)
+	{
+		omp_set_num_threads(1);
+		int t = omp_get_thread_num();
+		int step = 0;
+
+		for (int first = opts->step_threads[0]; t >= first; ) {
+			first += opts->step_threads[++step];
+		}
+
+		size_t step_failed = run_step(
+			&contexts[t], opts, batch, &next, step, queues
+		);
+
+		#pragma omp atomic
+		failed += step_failed;
+
+		int left;
+
+		#pragma omp atomic capture
+		left = --active[step];
+
+		// The last thread of a stage tells every thread
+		// of the next one that no more images are coming.
+		if (left == 0 && step + 1 < STEP_COUNT) {
+			for (int i = 0; i < opts->step_threads[step + 1]; i++) {
+				queue_push(&queues[step + 1], NULL);
+			}
+		}
+	}
+
+	for (int t = 0; t < total; t++) {
+		artistic_free(&contexts[t]);
+	}
+
+	for (int s = 1; s < STEP_COUNT; s++) {
+		queue_free(&queues[s]);
+	}
+
+	free(contexts);
+	return failed;
+#endif
+}
+
+#ifdef _OPENMP
+
+/**
+ * Work on one stage of a pipeline until it runs out of images,
+ * taking them from its queue and handing them to the next stage.
  *
- * args:
- * threshold: the higher it is, the less edges will be found.
- *			  should be a number between 0 and 4327.
+ * Returns the number of images that failed on this thread.
  */
-void detect_edges(
-	size_t width, size_t height,
-	Rgb in[][width], Rgb out[][width],
-	int threshold
+static size_t run_step(
+	ArtisticContext* ctx, const Options* opts, const Batch* batch,
+	size_t* next, Step step, Queue* queues
 ) {
-	static const int kernel_x[] = {
-		-1,  0, +1,
-		-2,  0, +2,
-		-1,  0, +1,
-	};
+	size_t failed = 0;
 
-	static const int kernel_y[] = {
-		+1, +2, +1,
-		 0,  0, 0,
-		-1, -2, -1,
-	};
+	for (;;) {
+		PipelineJob* job;
 
-	for (size_t row = 1; row < height-1; row++) {
-		for (size_t col = 1; col < width-1; col++) {
-			Rgb neighbors[] = {
-				in[row-1][col-1],
-				in[row-1][col],
-				in[row-1][col+1],
-				in[row][col-1],
-				in[row][col],
-				in[row][col+1],
-				in[row+1][col-1],
-				in[row+1][col],
-				in[row+1][col+1],
-			};
+		if (step == STEP_DECODE) {
+			size_t i;
 
-			int Gx = convolute(neighbors, 9, kernel_x);
-			int Gy = convolute(neighbors, 9, kernel_y);
-			int G = sqrt(Gx*Gx + Gy*Gy);
-			out[row][col] = G < threshold ? BLACK : WHITE;
+			#pragma omp atomic capture
+			i = (*next)++;
+
+			if (i >= batch->count) {
+				return failed;
+			}
+
+			job = decode_job(&batch->items[i], opts);
+
+			if (!job) {
+				failed++;
+				continue;
+			}
+		} else {
+			job = queue_pop(&queues[step]);
+
+			if (!job) {
+				return failed;
+			}
 		}
+
+		ArtisticStatus status = ARTISTIC_OK;
+
+		switch (step) {
+		case STEP_EDGES:
+			status = artistic_detect_edges(ctx, &job->params, &job->run);
+			break;
+		case STEP_SEEDS:
+			status = artistic_place_seeds(ctx, &job->params, &job->run);
+			break;
+		case STEP_STYLIZE:
+			job->out_mem = &ctx->mem;
+			job->out = alloc_view(
+				&ctx->mem, job->run.in.width, job->run.in.height
+			);
+			status = job->out.data
+				? artistic_stylize(ctx, &job->params, &job->run, job->out)
+				: ARTISTIC_OUT_OF_MEMORY;
+			break;
+		case STEP_ENCODE:
+			failed += !encode_job(job, opts);
+			continue;
+		default:
+			break;
+		}
+
+		// The later stages have nothing to work on if a step failed.
+		if (status != ARTISTIC_OK) {
+			drop_job(job, status);
+			failed++;
+			continue;
+		}
+
+		queue_push(&queues[step + 1], job);
 	}
 }
 
 /**
- * Compute the result of the sobel operator
- * for a given point of the given image.
+ * Load an image of a pipelined batch and start its run.
  *
- * See also: https://en.wikipedia.org/wiki/Sobel_operator
+ * Returns NULL if it can't be loaded, after logging why.
  */
-static int convolute(Rgb pixels[], int size, const int kernel[]) {
-	int result = 0;
+static PipelineJob* decode_job(const BatchItem* item, const Options* opts) {
+	PipelineJob* job = malloc(sizeof(PipelineJob));
 
-	for (size_t i = 0; i < size; i++) {
-		result += pixels[i].r * kernel[i];
-		result += pixels[i].g * kernel[i];
-		result += pixels[i].b * kernel[i];
+	if (!job) {
+		printf("Out of memory starting '%s'\n", item->path);
+		exit(1);
 	}
 
-	return result;
-}
+	timespec_get(&job->start, TIME_UTC);
+	job->item = item;
+	job->params = opts->params;
+	job->params.threshold = item->threshold;
 
-void keyboard(unsigned char key, int x, int y)
-{
-	// Listen for the ESC key.
-	if (key==27) {
-		free(imgs[0].data);
-		free(imgs[1].data);
-		exit(1);
+	int image_width, image_height, chan;
+	Rgb* data = (Rgb*) SOIL_load_image(
+		item->path, &image_width, &image_height, &chan, SOIL_LOAD_RGB
+	);
+
+	if (!data) {
+		printf("Batch error : can't load '%s'\n", item->path);
+		free(job);
+		return NULL;
 	}
 
-	if (key >= '1' && key <= '2') {
-		sel = key - '1';
+	artistic_begin(&job->run, image_view(data, image_width, image_height));
+	job->out_mem = NULL;
+	job->out = (ImageView) { NULL };
+	return job;
+}
+
+/**
+ * Save the result of an image of a pipelined batch and let go of it.
+ *
+ * Returns 0 if it can't be saved, after logging why.
+ */
+static int encode_job(PipelineJob* job, const Options* opts) {
+	const BatchItem* item = job->item;
+	ImageView in = job->run.in;
+	char path[4096];
+	batch_output_path(path, sizeof(path), opts->out_dir, item->path);
+
+	int saved = save_image(path, job->out);
+	free_view(job->out_mem, job->out);
+	artistic_end(&job->run);
+	SOIL_free_image_data((unsigned char*) in.data);
+
+	if (saved) {
+		struct timespec end;
+		timespec_get(&end, TIME_UTC);
+		double seconds = (end.tv_sec - job->start.tv_sec)
+			+ (end.tv_nsec - job->start.tv_nsec) / 1e9;
+
+		printf(
+			"Image       : %s %zu x %zu, threshold %d, %zu seeds, %.3f s -> %s\n",
+			item->path, in.width, in.height, item->threshold,
+			job->run.seed_count, seconds, path
+		);
+	} else {
+		printf("Batch error : can't write '%s'\n", path);
 	}
 
-	glutPostRedisplay();
+	free(job);
+	return saved;
 }
 
-void draw()
-{
-    glClearColor(0.0f, 0.0f, 0.0f, 1.0f);
-    glClear(GL_COLOR_BUFFER_BIT|GL_DEPTH_BUFFER_BIT);
+/**
+ * Let go of an image of a pipelined batch whose run failed,
+ * after logging why.
+ */
+static void drop_job(PipelineJob* job, ArtisticStatus status) {
+	const char* path = job->item->path;
 
-    glColor3ub(255, 255, 255);
+	if (status == ARTISTIC_OUT_OF_MEMORY) {
+		printf("Batch error : out of memory stylizing '%s'\n", path);
+	} else {
+		printf("Batch error : can't stylize '%s'\n", path);
+	}
 
-    // Activate the texture that corresponds to the selected image.
-    glBindTexture(GL_TEXTURE_2D, tex[sel]);
-	// Draw a rectangle that occupies the whole screen.
-    glEnable(GL_TEXTURE_2D);
-    glBegin(GL_QUADS);
+	free_view(job->out_mem, job->out);
+	artistic_end(&job->run);
+	SOIL_free_image_data((unsigned char*) job->run.in.data);
+	free(job);
+}
+#endif
 
-    glTexCoord2f(0,0);
-    glVertex2f(0,0);
+/**
+ * Listen on the unix socket at the source path and stylize the images
+ * sent to it, until killed.
+ *
+ * A team of workers takes connections in turn, each of them with its own
+ * context and request buffer that stay warm from one request to the next.
+ * Requests use the options of the command line unless they override them.
+ */
+int serve(const Options* opts) {
+#ifdef HAVE_POSIX
+	struct sockaddr_un address = { .sun_family = AF_UNIX };
 
-    glTexCoord2f(1,0);
-    glVertex2f(imgs[sel].width,0);
+	if (strlen(opts->source) >= sizeof(address.sun_path)) {
+		printf("Server error: socket path too long\n");
+		return 1;
+	}
 
-    glTexCoord2f(1,1);
-    glVertex2f(imgs[sel].width, imgs[sel].height);
+	strcpy(address.sun_path, opts->source);
+	struct stat info;
 
-    glTexCoord2f(0,1);
-    glVertex2f(0,imgs[sel].height);
+	// A socket left behind by a server that was killed goes,
+	// but anything else at that path is not for the server to remove.
+	if (lstat(opts->source, &info) == 0) {
+		if (!S_ISSOCK(info.st_mode)) {
+			printf("Server error: '%s' exists and is not a socket\n",
+				opts->source);
+			return 1;
+		}
 
-    glEnd();
-    glDisable(GL_TEXTURE_2D);
+		unlink(opts->source);
+	}
 
-	// Display the image.
-    glutSwapBuffers();
-}
+	int listener = socket(AF_UNIX, SOCK_STREAM, 0);
 
-void load(char* name, ImageRgb* pic)
-{
-    int chan;
-    pic->data = (Rgb*) SOIL_load_image(
-		name, &pic->width, &pic->height, &chan, SOIL_LOAD_RGB
-	);
+	if (listener < 0
+			|| bind(listener, (struct sockaddr*) &address, sizeof(address)) < 0
+			|| listen(listener, server_backlog) < 0) {
+		printf("Server error: can't listen on '%s'\n", opts->source);
+		return 1;
+	}
 
-    if(!pic->data) {
-        printf( "SOIL loading error: '%s'\n", SOIL_last_result() );
-        exit(1);
-    }
+	// Clients that hang up early must not take the server down with them.
+	signal(SIGPIPE, SIG_IGN);
 
-    printf("Load        : %d x %d x %d\n", pic->width, pic->height, chan);
+	int jobs = opts->jobs;
+
+	if (jobs <= 0) {
+#ifdef _OPENMP
+		jobs = omp_get_num_procs();
+#else
+		jobs = 1;
+#endif
+	}
+
+	// Pooling is what keeps the buffers warm between requests.
+	AllocatorKind allocator = opts->allocator == ALLOC_MALLOC
+		? ALLOC_POOL : opts->allocator;
+
+	printf("Server      : listening on %s with %d workers\n",
+		opts->source, jobs);
+	fflush(stdout);
+
+	#pragma omp parallel num_threads(jobs)
+	{
+#ifdef _OPENMP
+		omp_set_num_threads(1);
+#endif
+		ArtisticContext ctx;
+		artistic_init(&ctx, allocator);
+		Bytes request = { NULL };
+		long pause_ns = accept_pause_min_ns;
+
+		for (;;) {
+			int fd = accept(listener, NULL, NULL);
+
+			if (fd < 0) {
+				// A client that hung up before it was accepted is no reason
+				// to wait, but anything else is likely to fail again.
+				if (errno == EINTR || errno == ECONNABORTED) {
+					continue;
+				}
+
+				printf("Server error: can't accept a connection (%s)\n",
+					strerror(errno));
+				fflush(stdout);
+				nanosleep(&(struct timespec) {
+					pause_ns / 1000000000, pause_ns % 1000000000
+				}, NULL);
+
+				if (pause_ns < accept_pause_max_ns / 2) {
+					pause_ns *= 2;
+				} else {
+					pause_ns = accept_pause_max_ns;
+				}
+
+				continue;
+			}
+
+			pause_ns = accept_pause_min_ns;
+
+			struct timeval timeout = { request_timeout, 0 };
+			setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+			setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+
+			// A connection can carry any number of requests in turn.
+			while (serve_request(&ctx, &opts->params, &request, fd)) {
+				continue;
+			}
+
+			close(fd);
+		}
+	}
+
+	return 0;
+#else
+	printf("Server error: unix sockets are not supported here\n");
+	return 1;
+#endif
+}
+
+#ifdef HAVE_POSIX
+/**
+ * Read a request from a connection, stylize its image and send back
+ * the result, or an error message if that can't be done.
+ *
+ * A request is a magic number, then the text of its options and
+ * the encoded image, each of them after its length. A reply is a status,
+ * then the result as a PNG or the error message after its length.
+ * Numbers are 32 bits, big-endian.
+ *
+ * Returns 0 once the connection is closed or broken.
+ */
+static int serve_request(
+	ArtisticContext* ctx, const ArtisticParams* defaults,
+	Bytes* request, int fd
+) {
+	uint8_t header[8];
+
+	if (!read_full(fd, header, sizeof(header))
+			|| load_be32(header) != request_magic) {
+		return 0;
+	}
+
+	size_t params_size = load_be32(header + 4);
+
+	if (params_size >= request_params_max) {
+		return 0;
+	}
+
+	char text[request_params_max];
+
+	if (!read_full(fd, text, params_size)
+			|| !read_full(fd, header, 4)) {
+		return 0;
+	}
+
+	text[params_size] = '\0';
+	size_t image_size = load_be32(header);
+
+	if (image_size > request_image_max) {
+		send_reply(fd, 1, "image too large", strlen("image too large"));
+		return 0;
+	}
+
+	if (!reserve_bytes(request, image_size)
+			|| !read_full(fd, request->data, image_size)) {
+		return 0;
+	}
+
+	struct timespec start, end;
+	timespec_get(&start, TIME_UTC);
+
+	ArtisticParams params = *defaults;
+
+	if (!parse_request_params(text, &params)) {
+		return send_reply(fd, 1, "bad options", strlen("bad options"));
+	}
+
+	if (params.seed_budget > request_seeds_max
+			|| params.blur_radius > request_radius_max
+			|| params.morph_radius > request_radius_max) {
+		return send_reply(
+			fd, 1, "options too costly", strlen("options too costly")
+		);
+	}
+
+	// Only the header is read first, so that images too large
+	// are turned down before they are decoded.
+	int image_width, image_height, chan;
+
+	if (!stbi_info_from_memory(
+			request->data, image_size,
+			&image_width, &image_height, &chan)) {
+		const char* reason = stbi_failure_reason();
+		return send_reply(fd, 1, reason, strlen(reason));
+	}
+
+	if (image_width <= 0 || image_height <= 0
+			|| (size_t) image_width * image_height > request_pixels_max) {
+		return send_reply(
+			fd, 1, "image too large", strlen("image too large")
+		);
+	}
+
+	Rgb* data = (Rgb*) SOIL_load_image_from_memory(
+		request->data, image_size,
+		&image_width, &image_height, &chan, SOIL_LOAD_RGB
+	);
+
+	if (!data) {
+		const char* reason = SOIL_last_result();
+		return send_reply(fd, 1, reason, strlen(reason));
+	}
+
+	ImageView in = image_view(data, image_width, image_height);
+	ImageView out = alloc_view(&ctx->mem, image_width, image_height);
+	ArtisticStatus status = out.data
+		? artistic_run(ctx, &params, in, out) : ARTISTIC_OUT_OF_MEMORY;
+
+	char* png = NULL;
+	size_t png_size = 0;
+	FILE* file = status == ARTISTIC_OK ? open_memstream(&png, &png_size) : NULL;
+	int encoded = file && write_png_stream(file, out);
+
+	if (file) {
+		encoded = fclose(file) == 0 && encoded;
+	}
+
+	free_view(&ctx->mem, out);
+	SOIL_free_image_data((unsigned char*) data);
+
+	if (status != ARTISTIC_OK) {
+		const char* reason = status == ARTISTIC_OUT_OF_MEMORY
+			? "out of memory" : "can't stylize";
+		free(png);
+		return send_reply(fd, 1, reason, strlen(reason));
+	}
+
+	int sent = encoded
+		? send_reply(fd, 0, png, png_size)
+		: send_reply(fd, 1, "can't encode", strlen("can't encode"));
+	free(png);
+
+	timespec_get(&end, TIME_UTC);
+	double seconds = (end.tv_sec - start.tv_sec)
+		+ (end.tv_nsec - start.tv_nsec) / 1e9;
+
+	printf(
+		"Request     : %d x %d, threshold %d, %zu seeds, %.3f s\n",
+		image_width, image_height, params.threshold,
+		ctx->seed_count, seconds
+	);
+	fflush(stdout);
+	return sent;
+}
+
+/**
+ * Read the options of a request, which are a threshold followed by
+ * options of the pipeline as they are given on the command line.
+ *
+ * Returns 0 if any of them is invalid.
+ */
+static int parse_request_params(char* text, ArtisticParams* params) {
+	char* args[request_args_max];
+	int count = 0;
+	char* rest;
+
+	for (char* arg = strtok_r(text, " ", &rest); arg;
+			arg = strtok_r(NULL, " ", &rest)) {
+		if (count == request_args_max) {
+			return 0;
+		}
+
+		args[count++] = arg;
+	}
+
+	if (count > 0) {
+		char* end;
+		params->threshold = strtol(args[0], &end, 10);
+
+		if (*end != '\0') {
+			return 0;
+		}
+	}
+
+	for (int i = 1; i < count; i++) {
+		if (!parse_param(count, args, &i, params)) {
+			return 0;
+		}
+	}
+
+	return artistic_check_params(params);
+}
+
+static int send_reply(int fd, uint32_t status, const void* data, size_t size) {
+	uint8_t header[8];
+	store_be32(header, status);
+	store_be32(header + 4, size);
+
+	return write_full(fd, header, sizeof(header))
+		&& write_full(fd, data, size);
+}
+#endif
+
+/**
+ * Send the source image to the server on the unix socket given
+ * with --client, along with the options of the pipeline on the command
+ * line, and write what comes back to the output file.
+ *
+ * Stands in for the programs that talk to the server.
+ */
+int run_client(const Options* opts, int argc, char** argv) {
+#ifdef HAVE_POSIX
+	// The image written to stdout can't share it with the messages.
+	FILE* piped = NULL;
+
+	if (strcmp(opts->output, "-") == 0) {
+		piped = claim_stdout();
+	}
+
+	// The threshold and the options of the pipeline go as they are.
+	char text[request_params_max];
+	size_t length = snprintf(text, sizeof(text), "%s", argv[2]);
+
+	for (int i = 3; i < argc; i++) {
+		ArtisticParams params;
+		int start = i;
+
+		if (!parse_param(argc, argv, &i, &params)) {
+			// Options of the client itself, with their values.
+			i += strcmp(argv[i], "--client") == 0
+				|| strcmp(argv[i], "-o") == 0
+				|| strcmp(argv[i], "--output") == 0;
+			continue;
+		}
+
+		for (int j = start; j <= i && length < sizeof(text); j++) {
+			length += snprintf(
+				text + length, sizeof(text) - length, " %s", argv[j]
+			);
+		}
+	}
+
+	if (length >= sizeof(text)) {
+		printf("Client error: too many options\n");
+		return 1;
+	}
+
+	Bytes image;
+	FILE* source = strcmp(opts->source, "-") == 0
+		? stdin : fopen(opts->source, "rb");
+
+	if (!source || !read_bytes(source, &image)) {
+		printf("Client error: can't read '%s'\n", opts->source);
+		return 1;
+	}
+
+	struct sockaddr_un address = { .sun_family = AF_UNIX };
+	snprintf(
+		address.sun_path, sizeof(address.sun_path), "%s", opts->client
+	);
+	int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+
+	if (fd < 0
+			|| connect(fd, (struct sockaddr*) &address, sizeof(address)) < 0) {
+		printf("Client error: can't connect to '%s'\n", opts->client);
+		return 1;
+	}
+
+	struct timespec start, end;
+	timespec_get(&start, TIME_UTC);
+
+	uint8_t header[8];
+	store_be32(header, request_magic);
+	store_be32(header + 4, length);
+	int sent = write_full(fd, header, sizeof(header))
+		&& write_full(fd, text, length);
+	store_be32(header, image.size);
+	sent = sent && write_full(fd, header, 4)
+		&& write_full(fd, image.data, image.size);
+	size_t image_size = image.size;
+	free_bytes(&image);
+
+	Bytes reply = { NULL };
+
+	if (!sent || !read_full(fd, header, sizeof(header))
+			|| !reserve_bytes(&reply, load_be32(header + 4))
+			|| !read_full(fd, reply.data, load_be32(header + 4))) {
+		printf("Client error: the server hung up\n");
+		return 1;
+	}
+
+	close(fd);
+	reply.size = load_be32(header + 4);
+
+	if (load_be32(header) != 0) {
+		printf("Server error: %.*s\n", (int) reply.size, reply.data);
+		return 1;
+	}
+
+	timespec_get(&end, TIME_UTC);
+	double seconds = (end.tv_sec - start.tv_sec)
+		+ (end.tv_nsec - start.tv_nsec) / 1e9;
+
+	printf(
+		"Request     : %zu bytes sent, %zu bytes back, %.3f s\n",
+		image_size, reply.size, seconds
+	);
+
+	int saved = save_encoded(opts->output, piped, &reply);
+	free_bytes(&reply);
+
+	if (!saved) {
+		printf("Save error  : can't write '%s'\n", opts->output);
+		return 1;
+	}
+
+	printf("Output      : %s\n", opts->output);
+	return 0;
+#else
+	printf("Client error: unix sockets are not supported here\n");
+	return 1;
+#endif
+}
+
+/**
+ * Write a PNG that is already encoded to the given file, or to the given
+ * stream if there is one, converting it first if the file is not a PNG.
+ */
+static int save_encoded(const char* path, FILE* piped, const Bytes* png) {
+	if (!piped && !has_extension(path, ".png")) {
+		int image_width, image_height, chan;
+		Rgb* data = (Rgb*) SOIL_load_image_from_memory(
+			png->data, png->size,
+			&image_width, &image_height, &chan, SOIL_LOAD_RGB
+		);
+
+		if (!data) {
+			return 0;
+		}
+
+		int saved = save_image(
+			path, image_view(data, image_width, image_height)
+		);
+		SOIL_free_image_data((unsigned char*) data);
+		return saved;
+	}
+
+	FILE* file = piped ? piped : fopen(path, "wb");
+
+	if (!file) {
+		return 0;
+	}
+
+	size_t written = fwrite(png->data, 1, png->size, file);
+	return fclose(file) == 0 && written == png->size;
+}
+
+/**
+ * Make room for at least the given number of bytes,
+ * at least doubling the capacity whenever it has to grow.
+ *
+ * Returns 0 if there is no memory for them.
+ */
+int reserve_bytes(Bytes* bytes, size_t capacity) {
+	if (capacity <= bytes->capacity) {
+		return 1;
+	}
+
+	if (capacity < 2 * bytes->capacity) {
+		capacity = 2 * bytes->capacity;
+	}
+
+	uint8_t* data = realloc(bytes->data, capacity);
+
+	if (!data) {
+		return 0;
+	}
+
+	bytes->data = data;
+	bytes->capacity = capacity;
+	return 1;
+}
+
+#ifdef HAVE_POSIX
+/**
+ * Read exactly the given number of bytes from a socket.
+ *
+ * Returns 0 if it is closed or fails before that.
+ */
+static int read_full(int fd, void* data, size_t size) {
+	uint8_t* bytes = data;
+
+	while (size > 0) {
+		ssize_t n = read(fd, bytes, size);
+
+		if (n < 0 && errno == EINTR) {
+			continue;
+		}
+
+		if (n <= 0) {
+			return 0;
+		}
+
+		bytes += n;
+		size -= n;
+	}
+
+	return 1;
+}
+
+/**
+ * Write all of the given bytes to a socket.
+ *
+ * Returns 0 if it is closed or fails before that.
+ */
+static int write_full(int fd, const void* data, size_t size) {
+	const uint8_t* bytes = data;
+
+	while (size > 0) {
+		ssize_t n = write(fd, bytes, size);
+
+		if (n < 0 && errno == EINTR) {
+			continue;
+		}
+
+		if (n <= 0) {
+			return 0;
+		}
+
+		bytes += n;
+		size -= n;
+	}
+
+	return 1;
+}
+#endif
+
+static uint32_t load_be32(const uint8_t* bytes) {
+	return (uint32_t) bytes[0] << 24 | (uint32_t) bytes[1] << 16
+		| (uint32_t) bytes[2] << 8 | bytes[3];
+}
+
+/**
+ * Set up a queue with room for the given number of items,
+ * which must be a power of two.
+ */
+void queue_init(Queue* queue, size_t capacity) {
+	queue->cells = malloc(sizeof(QueueCell) * capacity);
+
+	if (!queue->cells) {
+		printf("Out of memory allocating a queue\n");
+		exit(1);
+	}
+
+	queue->mask = capacity - 1;
+
+	for (size_t i = 0; i < capacity; i++) {
+		atomic_init(&queue->cells[i].sequence, i);
+	}
+
+	atomic_init(&queue->head, 0);
+	atomic_init(&queue->tail, 0);
+}
+
+void queue_free(Queue* queue) {
+	free(queue->cells);
+	queue->cells = NULL;
+}
+
+/**
+ * Add an item to the queue, unless it is full.
+ *
+ * Every cell holds the position it is next written at, or that position
+ * plus one once it has been written and until it is read. A producer
+ * claims the cell at the head by moving the head past it, and only then
+ * writes the item and publishes it by bumping the sequence of the cell.
+ *
+ * Returns 0 if the queue is full.
+ *
+ * See also: https://www.1024cores.net/home/lock-free-algorithms/queues/bounded-mpmc-queue
+ */
+int queue_try_push(Queue* queue, void* item) {
+	size_t position = atomic_load_explicit(&queue->head, memory_order_relaxed);
+	QueueCell* cell;
+
+	for (;;) {
+		cell = &queue->cells[position & queue->mask];
+		size_t sequence = atomic_load_explicit(
+			&cell->sequence, memory_order_acquire
+		);
+		intptr_t diff = (intptr_t) sequence - (intptr_t) position;
+
+		if (diff == 0) {
+			if (atomic_compare_exchange_weak_explicit(
+					&queue->head, &position, position + 1,
+					memory_order_relaxed, memory_order_relaxed)) {
+				break;
+			}
+		} else if (diff < 0) {
+			return 0;
+		} else {
+			position = atomic_load_explicit(
+				&queue->head, memory_order_relaxed
+			);
+		}
+	}
+
+	cell->item = item;
+	atomic_store_explicit(
+		&cell->sequence, position + 1, memory_order_release
+	);
+	return 1;
+}
+
+/**
+ * Take the oldest item out of the queue, unless it is empty.
+ *
+ * Once read, a cell gets the position it is written at
+ * on the next lap around the queue.
+ *
+ * Returns 0 if the queue is empty.
+ */
+int queue_try_pop(Queue* queue, void** item) {
+	size_t position = atomic_load_explicit(&queue->tail, memory_order_relaxed);
+	QueueCell* cell;
+
+	for (;;) {
+		cell = &queue->cells[position & queue->mask];
+		size_t sequence = atomic_load_explicit(
+			&cell->sequence, memory_order_acquire
+		);
+		intptr_t diff = (intptr_t) sequence - (intptr_t) (position + 1);
+
+		if (diff == 0) {
+			if (atomic_compare_exchange_weak_explicit(
+					&queue->tail, &position, position + 1,
+					memory_order_relaxed, memory_order_relaxed)) {
+				break;
+			}
+		} else if (diff < 0) {
+			return 0;
+		} else {
+			position = atomic_load_explicit(
+				&queue->tail, memory_order_relaxed
+			);
+		}
+	}
+
+	*item = cell->item;
+	atomic_store_explicit(
+		&cell->sequence, position + queue->mask + 1, memory_order_release
+	);
+	return 1;
+}
+
+/**
+ * Add an item to the queue, waiting for room if it is full.
+ */
+void queue_push(Queue* queue, void* item) {
+	unsigned attempts = 0;
+
+	while (!queue_try_push(queue, item)) {
+		queue_backoff(&attempts);
+	}
+}
+
+/**
+ * Take the oldest item out of the queue, waiting for one if it is empty.
+ */
+void* queue_pop(Queue* queue) {
+	unsigned attempts = 0;
+	void* item;
+
+	while (!queue_try_pop(queue, &item)) {
+		queue_backoff(&attempts);
+	}
+
+	return item;
+}
+
+/**
+ * Give up the processor after failing to push to or pop from a queue,
+ * sleeping instead once that has gone on for a while, so that threads
+ * waiting on a slower stage leave the cores to it.
+ */
+static void queue_backoff(unsigned* attempts) {
+	if (*attempts < queue_spins) {
+		(*attempts)++;
+#ifdef WIN32
+		SwitchToThread();
+	} else {
+		Sleep(1);
+#else
+		sched_yield();
+	} else {
+		nanosleep(&(struct timespec) { 0, queue_sleep_ns }, NULL);
+#endif
+	}
+}
+
+/**
+ * Load, stylize and save one image of a batch with the given context.
+ *
+ * Returns 0 if it failed, after logging why.
+ */
+static int run_batch_item(
+	ArtisticContext* ctx, const Options* opts, const BatchItem* item
+) {
+	struct timespec start, end;
+	timespec_get(&start, TIME_UTC);
+
+	int image_width, image_height, chan;
+	Rgb* data = (Rgb*) SOIL_load_image(
+		item->path, &image_width, &image_height, &chan, SOIL_LOAD_RGB
+	);
+
+	if (!data) {
+		printf("Batch error : can't load '%s'\n", item->path);
+		return 0;
+	}
+
+	char path[4096];
+	batch_output_path(path, sizeof(path), opts->out_dir, item->path);
+
+	ImageView in = image_view(data, image_width, image_height);
+	ImageView out = alloc_view(&ctx->mem, image_width, image_height);
+	ArtisticParams params = opts->params;
+	params.threshold = item->threshold;
+
+	ArtisticStatus status = out.data
+		? artistic_run(ctx, &params, in, out) : ARTISTIC_OUT_OF_MEMORY;
+	int saved = status == ARTISTIC_OK && save_image(path, out);
+	free_view(&ctx->mem, out);
+	SOIL_free_image_data((unsigned char*) data);
+
+	if (status == ARTISTIC_OUT_OF_MEMORY) {
+		printf("Batch error : out of memory stylizing '%s'\n", item->path);
+		return 0;
+	} else if (status != ARTISTIC_OK) {
+		printf("Batch error : can't stylize '%s'\n", item->path);
+		return 0;
+	} else if (!saved) {
+		printf("Batch error : can't write '%s'\n", path);
+		return 0;
+	}
+
+	timespec_get(&end, TIME_UTC);
+	double seconds = (end.tv_sec - start.tv_sec)
+		+ (end.tv_nsec - start.tv_nsec) / 1e9;
+
+	printf(
+		"Image       : %s %d x %d, threshold %d, %zu seeds, %.3f s -> %s\n",
+		item->path, image_width, image_height, item->threshold,
+		ctx->seed_count, seconds, path
+	);
+	return 1;
+}
+
+/**
+ * Read the images of a batch from a directory, taking every image in it,
+ * or from a list file with one image per line.
+ *
+ * A line of the list can end with the threshold of its image,
+ * otherwise the given one is used. Blank lines and lines
+ * starting with '#' are skipped.
+ *
+ * Returns 0 if the source can't be read.
+ */
+int read_batch(Batch* batch, const char* source, int threshold) {
+	struct stat info;
+
+	if (stat(source, &info) != 0) {
+		return 0;
+	}
+
+	if (S_ISDIR(info.st_mode)) {
+		DIR* dir = opendir(source);
+
+		if (!dir) {
+			return 0;
+		}
+
+		struct dirent* entry;
+
+		while ((entry = readdir(dir))) {
+			if (!is_image_name(entry->d_name)) {
+				continue;
+			}
+
+			char path[4096];
+			snprintf(path, sizeof(path), "%s/%s", source, entry->d_name);
+			batch_push(batch, path, threshold);
+		}
+
+		closedir(dir);
+		// Directories list their files in no particular order.
+		qsort(batch->items, batch->count, sizeof(BatchItem), compare_items);
+		return 1;
+	}
+
+	FILE* file = fopen(source, "r");
+
+	if (!file) {
+		return 0;
+	}
+
+	char line[4096];
+
+	while (fgets(line, sizeof(line), file)) {
+		size_t length = strcspn(line, "\r\n");
+		line[length] = '\0';
+
+		if (length == 0 || line[0] == '#') {
+			continue;
+		}
+
+		// The threshold is the last word of the line, if it is a number.
+		int item_threshold = threshold;
+		char* last = strrchr(line, ' ');
+		char* tab = strrchr(line, '\t');
+		char* end;
+
+		if (!last || (tab && tab > last)) {
+			last = tab;
+		}
+
+		if (last && last[1] != '\0') {
+			long value = strtol(last + 1, &end, 10);
+
+			if (*end == '\0') {
+				item_threshold = value;
+
+				while (last > line && isspace((unsigned char) last[-1])) {
+					last--;
+				}
+
+				*last = '\0';
+			}
+		}
+
+		batch_push(batch, line, item_threshold);
+	}
+
+	fclose(file);
+	return 1;
+}
+
+void free_batch(Batch* batch) {
+	for (size_t i = 0; i < batch->count; i++) {
+		free(batch->items[i].path);
+	}
+
+	free(batch->items);
+	batch->items = NULL;
+	batch->count = batch->capacity = 0;
+}
+
+/**
+ * Add a copy of the given path to a batch.
+ */
+static void batch_push(Batch* batch, const char* path, int threshold) {
+	if (batch->count == batch->capacity) {
+		batch->capacity = batch->capacity ? batch->capacity * 2 : 16;
+		batch->items = realloc(
+			batch->items, sizeof(BatchItem) * batch->capacity
+		);
+	}
+
+	size_t length = strlen(path) + 1;
+	char* copy = malloc(length);
+	memcpy(copy, path, length);
+
+	if (!batch->items || !copy) {
+		printf("Out of memory reading the batch\n");
+		exit(1);
+	}
+
+	batch->items[batch->count++] = (BatchItem) { copy, threshold };
+}
+
+static int compare_items(const void* a, const void* b) {
+	return strcmp(((const BatchItem*) a)->path, ((const BatchItem*) b)->path);
+}
+
+/**
+ * Check if a file name has the extension of an image SOIL can load.
+ */
+static int is_image_name(const char* name) {
+	static const char* extensions[] = {
+		".png", ".jpg", ".jpeg", ".bmp", ".tga", ".psd", ".hdr", ".dds"
+	};
+
+	for (size_t i = 0; i < sizeof(extensions) / sizeof(*extensions); i++) {
+		if (has_extension(name, extensions[i])) {
+			return 1;
+		}
+	}
+
+	return 0;
+}
+
+/**
+ * Put together the path of the result of an image of a batch:
+ * a PNG with the name of the image in the output directory.
+ */
+static void batch_output_path(
+	char* out, size_t size, const char* dir, const char* path
+) {
+	OutputName name = output_name(path);
+	snprintf(out, size, "%s/%.*s.png", dir, name.length, name.name);
+}
+
+/**
+ * Find the name of the result of an image of a batch,
+ * which is its file name without the directory and the extension.
+ */
+static OutputName output_name(const char* path) {
+	const char* name = strrchr(path, '/');
+	name = name ? name + 1 : path;
+	const char* dot = strrchr(name, '.');
+	int length = dot && dot != name ? (int) (dot - name) : (int) strlen(name);
+
+	return (OutputName) { name, length, path };
+}
+
+static int compare_output_names(const void* a, const void* b) {
+	const OutputName* name_a = a;
+	const OutputName* name_b = b;
+	int length = name_a->length < name_b->length
+		? name_a->length : name_b->length;
+	int order = memcmp(name_a->name, name_b->name, length);
+
+	return order ? order : name_a->length - name_b->length;
+}
+
+/**
+ * Check that no two images of a batch, such as a.jpg and a.png or
+ * x/a.png and y/a.png, would be written to the same file,
+ * since their workers would then overwrite each other.
+ *
+ * Returns 0 after logging the first two that would.
+ */
+static int check_outputs(const Batch* batch) {
+	OutputName* names = malloc(sizeof(OutputName) * (batch->count + 1));
+
+	if (!names) {
+		printf("Out of memory reading the batch\n");
+		exit(1);
+	}
+
+	for (size_t i = 0; i < batch->count; i++) {
+		names[i] = output_name(batch->items[i].path);
+	}
+
+	qsort(names, batch->count, sizeof(OutputName), compare_output_names);
+	int unique = 1;
+
+	for (size_t i = 1; i < batch->count && unique; i++) {
+		if (compare_output_names(&names[i - 1], &names[i]) == 0) {
+			printf(
+				"Batch error : '%s' and '%s' would both be written to %.*s.png\n",
+				names[i - 1].path, names[i].path,
+				names[i].length, names[i].name
+			);
+			unique = 0;
+		}
+	}
+
+	free(names);
+	return unique;
+}
+
+void keyboard(unsigned char key, int x, int y)
+{
+	// Listen for the ESC key.
+	if (key==27) {
+		free(imgs[0].data);
+		free(imgs[1].data);
+		exit(1);
+	}
+
+	if (key >= '1' && key <= '2') {
+		sel = key - '1';
+	}
+
+	glutPostRedisplay();
+}
+
+void draw()
+{
+    glClearColor(0.0f, 0.0f, 0.0f, 1.0f);
+    glClear(GL_COLOR_BUFFER_BIT|GL_DEPTH_BUFFER_BIT);
+
+    glColor3ub(255, 255, 255);
+
+    // Activate the texture that corresponds to the selected image.
+    glBindTexture(GL_TEXTURE_2D, tex[sel]);
+	// Draw a rectangle that occupies the whole screen.
+    glEnable(GL_TEXTURE_2D);
+    glBegin(GL_QUADS);
+
+    glTexCoord2f(0,0);
+    glVertex2f(0,0);
+
+    glTexCoord2f(1,0);
+    glVertex2f(imgs[sel].width,0);
+
+    glTexCoord2f(1,1);
+    glVertex2f(imgs[sel].width, imgs[sel].height);
+
+    glTexCoord2f(0,1);
+    glVertex2f(0,imgs[sel].height);
+
+    glEnd();
+    glDisable(GL_TEXTURE_2D);
+
+	// Display the image.
+    glutSwapBuffers();
+}
+
+void load(char* name, ImageRgb* pic)
+{
+    int chan;
+
+	if (strcmp(name, "-") == 0) {
+		// Decode the image from memory, as the pipe can't be read twice.
+		Bytes bytes;
+		pic->data = NULL;
+
+		if (!read_bytes(stdin, &bytes)) {
+			printf("Load error  : can't read stdin\n");
+			exit(1);
+		}
+
+		if (bytes.size <= INT_MAX) {
+			pic->data = (Rgb*) SOIL_load_image_from_memory(
+				bytes.data, bytes.size,
+				&pic->width, &pic->height, &chan, SOIL_LOAD_RGB
+			);
+		}
+
+		free_bytes(&bytes);
+	} else {
+		pic->data = (Rgb*) SOIL_load_image(
+			name, &pic->width, &pic->height, &chan, SOIL_LOAD_RGB
+		);
+	}
+
+    if(!pic->data) {
+        printf( "SOIL loading error: '%s'\n", SOIL_last_result() );
+        exit(1);
+    }
+
+    printf("Load        : %d x %d x %d\n", pic->width, pic->height, chan);
+}
+
+/**
+ * Read the whole of a file into memory.
+ *
+ * A regular file, such as stdin redirected from one, is mapped as it is.
+ * Anything else is read straight into a buffer that doubles whenever
+ * it fills up, with the buffering of the file turned off so that
+ * the data is not copied on the way.
+ *
+ * Returns 0 if the file can't be read.
+ */
+int read_bytes(FILE* file, Bytes* bytes) {
+	*bytes = (Bytes) { NULL };
+
+#ifdef WIN32
+	_setmode(_fileno(file), _O_BINARY);
+#endif
+
+#ifdef HAVE_POSIX
+	struct stat info;
+	int fd = fileno(file);
+
+	if (fstat(fd, &info) == 0 && S_ISREG(info.st_mode) && info.st_size > 0
+			&& lseek(fd, 0, SEEK_CUR) == 0) {
+		void* data = mmap(NULL, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+
+		if (data != MAP_FAILED) {
+			*bytes = (Bytes) { data, info.st_size, info.st_size, 1 };
+			return 1;
+		}
+	}
+#endif
+
+	setvbuf(file, NULL, _IONBF, 0);
+
+	for (;;) {
+		if (bytes->size == bytes->capacity) {
+			size_t capacity = bytes->capacity
+				? 2 * bytes->capacity : read_chunk;
+			uint8_t* data = realloc(bytes->data, capacity);
+
+			if (!data) {
+				free_bytes(bytes);
+				return 0;
+			}
+
+			bytes->data = data;
+			bytes->capacity = capacity;
+		}
+
+		size_t n = fread(
+			bytes->data + bytes->size, 1,
+			bytes->capacity - bytes->size, file
+		);
+		bytes->size += n;
+
+		if (n == 0) {
+			if (ferror(file)) {
+				free_bytes(bytes);
+				return 0;
+			}
+
+			return 1;
+		}
+	}
+}
+
+void free_bytes(Bytes* bytes) {
+#ifdef HAVE_POSIX
+	if (bytes->mapped) {
+		munmap(bytes->data, bytes->size);
+		*bytes = (Bytes) { NULL };
+		return;
+	}
+#endif
+
+	free(bytes->data);
+	*bytes = (Bytes) { NULL };
+}
+
+/**
+ * Take stdout over to write an image to it, sending whatever is printed
+ * from then on to stderr instead.
+ *
+ * Returns the stream the image is written to.
+ */
+FILE* claim_stdout() {
+	fflush(stdout);
+	int fd = dup(fileno(stdout));
+	FILE* file = fd >= 0 ? fdopen(fd, "wb") : NULL;
+
+	if (!file || dup2(fileno(stderr), fileno(stdout)) < 0) {
+		printf("Save error  : can't write to stdout\n");
+		exit(1);
+	}
+
+#ifdef WIN32
+	_setmode(fd, _O_BINARY);
+#endif
+
+	return file;
+}
+
+/**
+ * Write an image to a file, picking its format from the extension.
+ *
+ * PNG is written by write_png(), while BMP, TGA and DDS go through SOIL.
+ * Returns 0 if the format is unknown or the file can't be written.
+ */
+int save_image(const char* path, ImageView image) {
+	int type;
+
+	if (has_extension(path, ".png")) {
+		return write_png(path, image);
+	} else if (has_extension(path, ".bmp")) {
+		type = SOIL_SAVE_TYPE_BMP;
+	} else if (has_extension(path, ".tga")) {
+		type = SOIL_SAVE_TYPE_TGA;
+	} else if (has_extension(path, ".dds")) {
+		type = SOIL_SAVE_TYPE_DDS;
+	} else {
+		return 0;
+	}
+
+	// SOIL needs the rows to follow each other.
+	Rgb* pixels = image.data;
+
+	if (image.stride != image.width) {
+		pixels = malloc(sizeof(Rgb) * image.width * image.height);
+
+		for (size_t row = 0; row < image.height; row++) {
+			memcpy(
+				pixels + row * image.width, view_row(image, row),
+				sizeof(Rgb) * image.width
+			);
+		}
+	}
+
+	int saved = SOIL_save_image(
+		path, type, image.width, image.height, 3, (unsigned char*) pixels
+	);
+
+	if (pixels != image.data) {
+		free(pixels);
+	}
+
+	return saved;
+}
+
+/**
+ * Whether the path ends with the given extension, ignoring case.
+ */
+static int has_extension(const char* path, const char* extension) {
+	size_t length = strlen(path);
+	size_t ext_length = strlen(extension);
+
+	if (length < ext_length) {
+		return 0;
+	}
+
+	for (size_t i = 0; i < ext_length; i++) {
+		if (tolower((unsigned char) path[length - ext_length + i])
+				!= extension[i]) {
+			return 0;
+		}
+	}
+
+	return 1;
+}
+
+/**
+ * Write an image to a PNG file without compressing it.
+ *
+ * The pixel rows go into deflate blocks that are stored as they are,
+ * which is the cheapest valid encoding: the file is only a few bytes
+ * per 64 KB larger than the raw pixels, and no compression library
+ * is needed.
+ *
+ * See also: https://www.w3.org/TR/png/ and RFC 1950, 1951.
+ */
+int write_png(const char* path, ImageView image) {
+	FILE* file = fopen(path, "wb");
+
+	if (!file) {
+		return 0;
+	}
+
+	int written = write_png_stream(file, image);
+	return fclose(file) == 0 && written;
+}
+
+/**
+ * Write an image as a PNG to a stream that is already open,
+ * such as stdout.
+ */
+int write_png_stream(FILE* file, ImageView image) {
+	static const uint8_t signature[8] = {
+		0x89, 'P', 'N', 'G', '\r', '\n', 0x1A, '\n'
+	};
+	// Deflate with a 32 KB window, no preset dictionary.
+	static const uint8_t zlib_header[2] = { 0x78, 0x01 };
+	static const uint8_t no_filter = 0;
+
+	uint8_t header[13];
+	store_be32(header, image.width);
+	store_be32(header + 4, image.height);
+	header[8] = 8;  // Bits per channel.
+	header[9] = 2;  // Truecolor.
+	header[10] = header[11] = header[12] = 0;
+
+	fwrite(signature, 1, sizeof(signature), file);
+	write_png_chunk(file, "IHDR", header, sizeof(header));
+	write_png_chunk(file, "IDAT", zlib_header, sizeof(zlib_header));
+
+	PngStream* stream = malloc(sizeof(PngStream));
+	if (!stream) {
+		return 0;
+	}
+	stream->file = file;
+	stream->used = 0;
+	stream->adler = 1;
+	stream->remaining = (uint64_t) image.height * (1 + 3 * image.width);
+
+	for (size_t row = 0; row < image.height; row++) {
+		const uint8_t* pixels = (const uint8_t*) view_row(image, row);
+		png_store(stream, &no_filter, 1);
+		png_store(stream, pixels, 3 * image.width);
+	}
+
+	free(stream);
+	write_png_chunk(file, "IEND", NULL, 0);
+
+	return fflush(file) == 0 && !ferror(file);
+}
+
+/**
+ * Add bytes to the stored deflate stream of a PNG, writing every block
+ * out as an IDAT chunk once it is full, and the checksum of the zlib
+ * stream after the last one.
+ */
+static void png_store(PngStream* stream, const uint8_t* bytes, size_t length) {
+	while (length > 0) {
+		size_t n = png_block_size - stream->used;
+		n = n < length ? n : length;
+
+		memcpy(stream->block + 5 + stream->used, bytes, n);
+		update_adler32(&stream->adler, bytes, n);
+		stream->used += n;
+		stream->remaining -= n;
+		bytes += n;
+		length -= n;
+
+		if (stream->used < png_block_size && stream->remaining > 0) {
+			continue;
+		}
+
+		uint8_t* block = stream->block;
+		size_t size = 5 + stream->used;
+		block[0] = stream->remaining == 0;
+		block[1] = stream->used;
+		block[2] = stream->used >> 8;
+		block[3] = ~stream->used;
+		block[4] = ~stream->used >> 8;
+
+		if (stream->remaining == 0) {
+			store_be32(block + size, stream->adler);
+			size += 4;
+		}
+
+		write_png_chunk(stream->file, "IDAT", block, size);
+		stream->used = 0;
+	}
+}
+
+/**
+ * Write a PNG chunk: its length, its type, its data and
+ * the CRC of its type and data.
+ */
+static void write_png_chunk(
+	FILE* file, const char type[4], const uint8_t* data, size_t length
+) {
+	uint8_t size[4], crc[4];
+	uint32_t checksum = update_crc32(0xFFFFFFFF, (const uint8_t*) type, 4);
+	checksum = update_crc32(checksum, data, length) ^ 0xFFFFFFFF;
+
+	store_be32(size, length);
+	store_be32(crc, checksum);
+	fwrite(size, 1, 4, file);
+	fwrite(type, 1, 4, file);
+
+	if (length > 0) {
+		fwrite(data, 1, length, file);
+	}
+
+	fwrite(crc, 1, 4, file);
+}
+
+/**
+ * Carry on a CRC-32 over more bytes, four bits at a time.
+ */
+static uint32_t update_crc32(
+	uint32_t crc, const uint8_t* bytes, size_t length
+) {
+	static const uint32_t nibbles[16] = {
+		0x00000000, 0x1DB71064, 0x3B6E20C8, 0x26D930AC,
+		0x76DC4190, 0x6B6B51F4, 0x4DB26158, 0x5005713C,
+		0xEDB88320, 0xF00F9344, 0xD6D6A3E8, 0xCB61B38C,
+		0x9B64C2B0, 0x86D3D2D4, 0xA00AE278, 0xBDBDF21C,
+	};
+
+	for (size_t i = 0; i < length; i++) {
+		crc ^= bytes[i];
+		crc = (crc >> 4) ^ nibbles[crc & 15];
+		crc = (crc >> 4) ^ nibbles[crc & 15];
+	}
+
+	return crc;
+}
+
+/**
+ * Carry on an Adler-32 checksum over more bytes, only reducing its sums
+ * as often as needed to keep them from overflowing.
+ */
+static void update_adler32(
+	uint32_t* adler, const uint8_t* bytes, size_t length
+) {
+	enum { modulus = 65521, run = 5552 };
+	uint32_t a = *adler & 0xFFFF;
+	uint32_t b = *adler >> 16;
+
+	while (length > 0) {
+		size_t n = length < run ? length : run;
+
+		for (size_t i = 0; i < n; i++) {
+			a += bytes[i];
+			b += a;
+		}
+
+		a %= modulus;
+		b %= modulus;
+		bytes += n;
+		length -= n;
+	}
+
+	*adler = b << 16 | a;
 }
 
+static void store_be32(uint8_t* bytes, uint32_t value) {
+	bytes[0] = value >> 24;
+	bytes[1] = value >> 16;
+	bytes[2] = value >> 8;
+	bytes[3] = value;
+}
\ No newline at end of file